@@ -25,12 +25,15 @@
 #include <map>
 #include <iterator>
 #include <csignal>
+#include <fstream>
 #include <random>
 
 #include <grpc/support/log.h>
 #include <grpcpp/grpcpp.h>
+#include <google/protobuf/util/json_util.h>
 
 #include "hindsightgrpc/server.h"
+#include "tracing/otel_context.h"
 
 #include "hindsightgrpc.grpc.pb.h"
 #include <argp.h>
@@ -43,6 +46,11 @@ static char doc[] = "A gRPC async client to the server.  The SERV argument speci
                     "To run a standalone client, simply run ./server standalone";
 static char args_doc[] = "SERV";
 
+// Options without a short form
+#define OPT_SEED 1000
+#define OPT_SCRAPE 1001
+#define OPT_SCRAPE_INTERVAL 1002
+
 static struct argp_option options[] = {
   {"concurrency",  'c', "NUM",  0,  "The number of concurrent client threads to run.  Each thread has its own RPC client.  Default 1." },
   {"requests",  'r', "NUM",  0,  "If running as an closed-loop client, this specifies the number of concurrent outstanding requests per client.  If running as an open-loop client, this specifies the request rate per second per client.  Default 1." },  
@@ -54,6 +62,11 @@ static struct argp_option options[] = {
   {"interval", 'i', "NUM", 0, "Interval size in seconds, default 10.  Each trace will log the interval when it was generated." },
   // only for opentelemetry based tracers
   {"sampling",  's', "NUM",  0,  "Probability of head-based sampling. Default 1." },
+  {"seed", OPT_SEED, "NUM", 0, "Seed for the client's random number generators, which pick APIs, sampling decisions and per-trace fan-out keys.  "
+                               "Default 0, which picks a random seed and prints it." },
+  {"scrape", OPT_SCRAPE, "FILE", 0, "Scrape the Stats of every server in the addresses file once per --scrape_interval, and append them to FILE "
+                                    "as JSON, one line per server per scrape.  With -c 0, only scrapes, until interrupted." },
+  {"scrape_interval", OPT_SCRAPE_INTERVAL, "MS", 0, "How often to scrape servers, in milliseconds.  Default 1000." },
   { 0 }
 };
 
@@ -68,6 +81,9 @@ struct arguments {
   char* topology_filename;
   char* addresses_filename;
   float sampling;
+  uint64_t seed;
+  char* scrape_filename;
+  int scrape_interval;
 };
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
@@ -99,6 +115,15 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     case 'a':
       arguments->addresses_filename = arg;
       break;
+    case OPT_SEED:
+      arguments->seed = strtoull(arg, NULL, 10);
+      break;
+    case OPT_SCRAPE:
+      arguments->scrape_filename = arg;
+      break;
+    case OPT_SCRAPE_INTERVAL:
+      arguments->scrape_interval = atoi(arg);
+      break;
     case 's':
       arguments->sampling = atof(arg);
     case ARGP_KEY_ARG:
@@ -131,6 +156,8 @@ using grpc::Status;
 using hindsightgrpc::HindsightGRPC;
 using hindsightgrpc::ExecRequest;
 using hindsightgrpc::ExecReply;
+using hindsightgrpc::StatsRequest;
+using hindsightgrpc::StatsReply;
 using opentelemetry::sdk::trace::IdGenerator;
 using opentelemetry::sdk::trace::RandomIdGenerator;
 
@@ -160,24 +187,27 @@ class HindsightGRPCClient {
   IdGenerator* id_generator = new RandomIdGenerator();
   bool openloop;
   int requests;
+  // Whether the server understands binary trace context ids
+  bool binary_context = false;
 
-  // For generating openloop interarrival times
-  std::minstd_rand rng;
+  // For picking APIs, sampling, fan-out keys and openloop interarrival times
+  hindsightgrpc::Xoshiro256 rng;
   std::exponential_distribution<double> exp;
 
   explicit HindsightGRPCClient(int id, std::shared_ptr<Channel> channel, 
-      const std::map<std::string, hindsightgrpc::API> apis, uint64_t interval_s, bool openloop, int requests)
+      const std::map<std::string, hindsightgrpc::API> apis, uint64_t interval_s, bool openloop, int requests,
+      uint64_t seed)
       : stub_(HindsightGRPC::NewStub(channel)), apis_(apis), begin(now()), interval(interval_s * 1000000ULL), 
-      openloop(openloop), requests(requests), rng(id), exp(((double) requests) / 1000000000.0) {}
+      openloop(openloop), requests(requests), rng(hindsightgrpc::mix64(seed + id)), exp(((double) requests) / 1000000000.0) {}
 
   void ExecNext() {
     auto api_iter = apis_.begin();
-    std::advance(api_iter, rand() % apis_.size());
-    Exec(api_iter->first);
+    std::advance(api_iter, rng.Below(apis_.size()));
+    Exec(api_iter->first, api_iter->second.id, api_iter->second.priority);
   }
 
   // Assembles the client's payload and sends it to the server.
-  void Exec(const std::string& api_name) {
+  void Exec(const std::string& api_name, int api_id, int priority) {
 
     // Call object to store rpc data
     AsyncClientCall* call = new AsyncClientCall;
@@ -189,18 +219,19 @@ class HindsightGRPCClient {
     // Data we are sending to the server.
     ExecRequest request;
     request.set_api(api_name);
+    request.set_api_id(api_id);
+    request.set_priority(priority);
     request.set_debug(debug);
     request.set_interval(interval);
 
     // generating trace id and making head-based sampling decision
     auto tid_raw = id_generator->GenerateTraceId();
-    char tid_buffer[32];
-    tid_raw.ToLowerBase16(nostd::span<char, 32>{&tid_buffer[0], 32});
-    request.mutable_otel()->set_trace_id(std::string(tid_buffer, 32));
-    // special span id
-    request.mutable_otel()->set_span_id(std::string("ffffffffffffffff"));
+    // special span id, ffffffffffffffff
+    uint8_t sid_raw[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    hindsightgrpc::set_otel_context_ids(request.mutable_otel(), tid_raw,
+        opentelemetry::trace::SpanId(sid_raw), binary_context);
     // set the sample flag with probability specified by user commands
-    request.mutable_otel()->set_sample(rand() / sample_probability > RAND_MAX ? false : true);
+    request.mutable_otel()->set_sample(rng.Uniform() < sample_probability);
 
     // truncate the first 64 bits to fit into hindsight
     uint64_t trace_id = *((uint64_t*) tid_raw.Id().data());
@@ -209,6 +240,9 @@ class HindsightGRPCClient {
     request.mutable_hindsight()->set_span_id(0);
     request.mutable_hindsight()->set_triggerflag(true);
 
+    // servers may derive their fan-out decisions from this
+    request.set_fanout_key(rng.Next());
+
     // Create the RPC object, but don't actually send it yet
     call->response_reader =
         stub_->PrepareAsyncExec(&call->context, request, &cq_);
@@ -241,7 +275,7 @@ class HindsightGRPCClient {
 
     // Used for open-loop
     uint64_t ns_per_request = 1000000000LL / requests;
-    uint64_t next_request_at = now() * 1000 + ns_per_request * ((double) rng()) / ((double) rng.max());
+    uint64_t next_request_at = now() * 1000 + ns_per_request * rng.Uniform();
 
     // If closed-loop, submit initial requests
     if (!openloop) {
@@ -304,6 +338,9 @@ class HindsightGRPCClient {
         } else {
           /* Calculate statistics of successful completed requests */
           iserror = false;
+          if (call->reply.binary_trace_context()) {
+            binary_context = true;
+          }
           received_count++;
           global_count++;
 
@@ -423,6 +460,85 @@ void printthread(struct arguments arguments, std::atomic_bool* alive, std::vecto
             << min_latency / float(1000) << " ms\n";
 }
 
+// Calls the Stats RPC of every instance of every service in addresses at
+// each interval, and writes each reply as a line of JSON
+void scrapethread(struct arguments arguments, std::map<std::string, hindsightgrpc::AddressInfo> addresses) {
+  std::ofstream out(arguments.scrape_filename, std::ios::app);
+  if (!out) {
+    std::cerr << "Unable to open " << arguments.scrape_filename << " for scraping" << std::endl;
+    return;
+  }
+
+  struct Target {
+    std::string service;
+    int instance;
+    std::string address;
+    std::unique_ptr<HindsightGRPC::Stub> stub;
+  };
+  std::vector<Target> targets;
+  for (auto &p : addresses) {
+    for (int i = 0; i < p.second.num_instances; i++) {
+      std::string address = p.second.connection_addresses[i];
+      targets.push_back({p.first, i, address,
+        HindsightGRPC::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()))});
+    }
+  }
+  std::cout << "Scraping " << targets.size() << " servers every " << arguments.scrape_interval
+            << " ms to " << arguments.scrape_filename << std::endl;
+
+  struct Scrape {
+    ClientContext context;
+    StatsReply reply;
+    Status status;
+    std::unique_ptr<ClientAsyncResponseReader<StatsReply>> response_reader;
+  };
+
+  google::protobuf::util::JsonPrintOptions json_options;
+  json_options.preserve_proto_field_names = true;
+
+  uint64_t interval = arguments.scrape_interval * 1000ULL;
+  uint64_t next_scrape = now();
+  for (uint64_t scrape = 0; alive; scrape++) {
+    // Scrape all the servers at once, giving each until the next scrape
+    CompletionQueue cq;
+    std::vector<Scrape> scrapes(targets.size());
+    StatsRequest request;
+    uint64_t begin = now();
+    for (size_t i = 0; i < targets.size(); i++) {
+      scrapes[i].context.set_deadline(std::chrono::system_clock::now() + std::chrono::microseconds(interval));
+      scrapes[i].response_reader = targets[i].stub->AsyncStats(&scrapes[i].context, request, &cq);
+      scrapes[i].response_reader->Finish(&scrapes[i].reply, &scrapes[i].status, &scrapes[i]);
+    }
+    void* tag;
+    bool ok;
+    for (size_t i = 0; i < targets.size(); i++) {
+      cq.Next(&tag, &ok);
+    }
+    cq.Shutdown();
+    while (cq.Next(&tag, &ok)) {}
+
+    for (size_t i = 0; i < targets.size(); i++) {
+      out << "{\"scrape\":" << scrape << ",\"time_us\":" << begin
+          << ",\"service\":\"" << targets[i].service << "\",\"instance\":" << targets[i].instance
+          << ",\"address\":\"" << targets[i].address << "\",";
+      if (scrapes[i].status.ok()) {
+        std::string stats;
+        google::protobuf::util::MessageToJsonString(scrapes[i].reply, &stats, json_options);
+        out << "\"stats\":" << stats << "}\n";
+      } else {
+        out << "\"error\":" << json(scrapes[i].status.error_message()).dump() << "}\n";
+      }
+    }
+    out.flush();
+
+    next_scrape += interval;
+    uint64_t t;
+    while ((t = now()) < next_scrape && alive) {
+      usleep(std::min<uint64_t>(next_scrape - t, 10000));
+    }
+  }
+}
+
 void exitHandler(int signum) {
   exit(signum);
 }
@@ -456,12 +572,25 @@ int main(int argc, char** argv) {
   arguments.interval = 10;
   arguments.sampling = 1;
   arguments.openloop = false;
+  arguments.seed = 0;
+  arguments.scrape_filename = NULL;
+  arguments.scrape_interval = 1000;
 
   /* Parse the arguments */
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
   sample_probability = arguments.sampling;
 
+  if (arguments.concurrency == 0 && arguments.scrape_filename == NULL) {
+    std::cout << "Nothing to do with -c 0 unless scraping" << std::endl;
+    return 1;
+  }
+
+  if (arguments.scrape_interval < 1) {
+    std::cout << "Must use a positive value for --scrape_interval; got " << arguments.scrape_interval << std::endl;
+    return 1;
+  }
+
   if (arguments.requests < 1) {
     std::cout << "Must use a positive value for -r --requests; got " << arguments.requests << std::endl;
     return 1;
@@ -519,23 +648,35 @@ int main(int argc, char** argv) {
   std::vector<std::thread> threads;
   const std::map<std::string, hindsightgrpc::API> apis = service_config.get_apis();
 
+  uint64_t seed = arguments.seed != 0 ? arguments.seed : hindsightgrpc::random_seed();
+  std::cout << "Using seed " << seed << std::endl;
+  hindsightgrpc::Xoshiro256 rng(seed);
+
   std::vector<std::shared_ptr<HindsightGRPCClient>> clients;
   for (int i = 0; i < arguments.concurrency; i++) {
     // clients.push_back(std::make_shared<HindsightGRPCClient>(i,
     //     grpc::CreateChannel(connection_address, grpc::InsecureChannelCredentials()), apis, 
     //     arguments.interval, arguments.openloop, arguments.requests));
-    auto connection_address = connection_addresses[rand() % connection_addresses.size()];
+    auto connection_address = connection_addresses[rng.Below(connection_addresses.size())];
     clients.push_back(std::make_shared<HindsightGRPCClient>(i,
-        grpc::CreateChannel(connection_address, grpc::InsecureChannelCredentials()), apis, arguments.interval, arguments.openloop, arguments.requests));
+        grpc::CreateChannel(connection_address, grpc::InsecureChannelCredentials()), apis, arguments.interval, arguments.openloop, arguments.requests, seed));
 
     // Spawn reader thread that loops indefinitely
     threads.push_back(
         std::thread(&HindsightGRPCClient::AsyncCompleteRpc, clients[i]));
   }
 
+  std::thread scraper;
+  if (arguments.scrape_filename != NULL) {
+    scraper = std::thread(&scrapethread, arguments, addresses);
+  }
+
   std::atomic_bool printer_alive{true};
 
-  std::thread printer = std::thread(&printthread, arguments, &printer_alive, &clients);
+  std::thread printer;
+  if (arguments.concurrency > 0) {
+    printer = std::thread(&printthread, arguments, &printer_alive, &clients);
+  }
 
 
   if (max_requests == 0) {
@@ -547,7 +688,17 @@ int main(int argc, char** argv) {
   }
 
   printer_alive = false;
-  printer.join();
+  if (printer.joinable()) {
+    printer.join();
+  }
+
+  // Without clients, scrape until interrupted
+  if (scraper.joinable()) {
+    if (arguments.concurrency > 0) {
+      alive = false;
+    }
+    scraper.join();
+  }
 
   return 0;
 }
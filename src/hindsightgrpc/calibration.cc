@@ -0,0 +1,230 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "calibration.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+namespace hindsightgrpc {
+
+    static double elapsed_ms(std::chrono::steady_clock::time_point begin) {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - begin).count();
+    }
+
+    double measure_matrix_multiply(MatrixWorkspace& workspace, const MatrixConfig& config) {
+        // Warm up, and use the warm-up to size each trial to roughly 2ms
+        auto begin = std::chrono::steady_clock::now();
+        workspace.Multiply(config);
+        double once = elapsed_ms(begin);
+        int iterations = std::max(1, std::min(1000, (int) (2.0 / std::max(once, 1e-6))));
+
+        double best = std::numeric_limits<double>::max();
+        int trials = once > 10 ? 3 : 5;
+        for (int trial = 0; trial < trials; trial++) {
+            begin = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                workspace.Multiply(config);
+            }
+            best = std::min(best, elapsed_ms(begin) / iterations);
+        }
+        return best;
+    }
+
+    WorkModel WorkModel::Calibrate(MatrixWorkspace& workspace) {
+        std::vector<MatrixConfig> shapes;
+        shapes.push_back(MatrixConfig(16, 256, 16));
+        shapes.push_back(MatrixConfig(256, 16, 256));
+        shapes.push_back(MatrixConfig(64, 512, 32));
+        shapes.push_back(MatrixConfig(512, 64, 128));
+        shapes.push_back(MatrixConfig(32, 32, 512));
+        int cubes[] = {8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 640, 768};
+        for (int s : cubes) {
+            shapes.push_back(MatrixConfig(s, s, s));
+        }
+
+        // Weighted least squares on the relative error, via the normal equations
+        double ata[3][3] = {{0}}, atb[3] = {0};
+        for (auto &config : shapes) {
+            workspace.Reserve(config);
+            double t = measure_matrix_multiply(workspace, config);
+            double m = config.m_, n = config.n_, k = config.k_;
+            double x[3] = {1, m * n * k, m * n + n * k + m * k};
+            double w = 1.0 / (t * t);
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) ata[i][j] += w * x[i] * x[j];
+                atb[i] += w * x[i] * t;
+            }
+
+            // Larger cubes only add calibration time on slow kernels
+            if (t > 50) break;
+        }
+
+        // Gaussian elimination with partial pivoting
+        for (int col = 0; col < 3; col++) {
+            int pivot = col;
+            for (int row = col + 1; row < 3; row++) {
+                if (std::abs(ata[row][col]) > std::abs(ata[pivot][col])) pivot = row;
+            }
+            std::swap(ata[col], ata[pivot]);
+            std::swap(atb[col], atb[pivot]);
+            for (int row = col + 1; row < 3; row++) {
+                double f = ata[row][col] / ata[col][col];
+                for (int j = col; j < 3; j++) ata[row][j] -= f * ata[col][j];
+                atb[row] -= f * atb[col];
+            }
+        }
+        double c[3];
+        for (int row = 2; row >= 0; row--) {
+            double sum = atb[row];
+            for (int j = row + 1; j < 3; j++) sum -= ata[row][j] * c[j];
+            c[row] = sum / ata[row][row];
+        }
+
+        WorkModel model;
+        model.c0 = std::max(0.0, c[0]);
+        model.c1 = std::max(0.0, c[1]);
+        model.c2 = std::max(0.0, c[2]);
+        return model;
+    }
+
+    double WorkModel::Predict(const MatrixConfig& config) const {
+        double m = config.m_, n = config.n_, k = config.k_;
+        return c0 + c1 * m * n * k + c2 * (m * n + n * k + m * k);
+    }
+
+    MatrixConfig WorkModel::Solve(double target_ms, double tolerance) const {
+        // Candidate dimensions get coarser as they get larger
+        std::vector<int> dims;
+        for (int d = 4; d <= 64; d += 4) dims.push_back(d);
+        for (int d = 72; d <= 256; d += 8) dims.push_back(d);
+        for (int d = 272; d <= 1024; d += 16) dims.push_back(d);
+        for (int d = 1056; d <= 2048; d += 32) dims.push_back(d);
+
+        MatrixConfig closest(dims[0], dims[0], dims[0]), cubic;
+        double closest_error = std::numeric_limits<double>::max();
+        double cubic_aspect = std::numeric_limits<double>::max();
+        for (int m : dims) {
+            for (int n : dims) {
+                for (int k : dims) {
+                    MatrixConfig config(m, n, k);
+                    double error = std::abs(Predict(config) - target_ms) / target_ms;
+                    if (error < closest_error) {
+                        closest_error = error;
+                        closest = config;
+                    }
+                    if (error <= tolerance) {
+                        double aspect = (double) std::max(m, std::max(n, k)) / std::min(m, std::min(n, k));
+                        if (aspect < cubic_aspect) {
+                            cubic_aspect = aspect;
+                            cubic = config;
+                        }
+                    }
+                }
+            }
+        }
+        return cubic_aspect < std::numeric_limits<double>::max() ? cubic : closest;
+    }
+
+    std::string cpu_model_name() {
+        std::ifstream fin("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (line.compare(0, 10, "model name") == 0) {
+                size_t pos = line.find(':');
+                if (pos == std::string::npos) break;
+                std::string name = line.substr(line.find_first_not_of(' ', pos + 1));
+                std::replace(name.begin(), name.end(), ',', ' ');
+                return name;
+            }
+        }
+        return "unknown";
+    }
+
+    std::string default_calibration_cache() {
+        std::string dir;
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        if (xdg != nullptr && xdg[0] != '\0') {
+            dir = xdg;
+        } else if (home != nullptr && home[0] != '\0') {
+            dir = std::string(home) + "/.cache";
+        } else {
+            dir = "/tmp";
+        }
+        return dir + "/microbricks/work_model.csv";
+    }
+
+    bool load_work_model(const std::string& filename, WorkModel& model) {
+        std::ifstream fin(filename);
+        if (!fin.is_open()) return false;
+
+        std::string cpu = cpu_model_name();
+        std::string kernel = work_kernel_name();
+        std::string line;
+        while (std::getline(fin, line)) {
+            std::vector<std::string> row;
+            std::stringstream str(line);
+            std::string word;
+            while (std::getline(str, word, ',')) {
+                row.push_back(word);
+            }
+            if (row.size() == 5 && row[0] == cpu && row[1] == kernel) {
+                model.c0 = std::stod(row[2]);
+                model.c1 = std::stod(row[3]);
+                model.c2 = std::stod(row[4]);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool save_work_model(const std::string& filename, const WorkModel& model) {
+        std::string cpu = cpu_model_name();
+        std::string kernel = work_kernel_name();
+
+        // Keep the models for other CPUs and kernels
+        std::vector<std::string> lines;
+        {
+            std::ifstream fin(filename);
+            std::string line;
+            while (std::getline(fin, line)) {
+                if (line.compare(0, 4, "cpu,") == 0) continue;
+                if (line.compare(0, cpu.size() + kernel.size() + 2, cpu + "," + kernel + ",") == 0) continue;
+                lines.push_back(line);
+            }
+        }
+
+        // Create the cache directory, and its parent, if needed
+        size_t slash = filename.rfind('/');
+        if (slash != std::string::npos && slash > 0) {
+            std::string dir = filename.substr(0, slash);
+            size_t parent = dir.rfind('/');
+            if (parent != std::string::npos && parent > 0) {
+                mkdir(dir.substr(0, parent).c_str(), 0755);
+            }
+            mkdir(dir.c_str(), 0755);
+        }
+
+        std::ofstream fout(filename, std::ios::trunc);
+        if (!fout.is_open()) return false;
+        fout.precision(17);
+        fout << "cpu,kernel,c0,c1,c2\n";
+        for (auto &line : lines) {
+            fout << line << "\n";
+        }
+        fout << cpu << "," << kernel << "," << model.c0 << "," << model.c1 << "," << model.c2 << "\n";
+        return fout.good();
+    }
+
+}  // namespace hindsightgrpc
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_CALIBRATION_H_
+#define SRC_HINDSIGHTGRPC_CALIBRATION_H_
+
+#include <string>
+
+#include "work.h"
+
+namespace hindsightgrpc {
+
+  /* A cost model for the matrix multiplication task on the local CPU with the
+  active kernel.  The time in milliseconds of an (m, n, k) multiply is
+  modelled as
+
+      c0 + c1 * m*n*k + c2 * (m*n + n*k + m*k)
+
+  ie a fixed overhead, a compute term, and a term for touching the operands.
+  The coefficients are fit to microbenchmarks of the kernel. */
+  class WorkModel {
+    public:
+    WorkModel() : c0(0), c1(0), c2(0) {}
+
+    /* Microbenchmarks the active kernel on a range of shapes and fits the
+    model.  Takes on the order of a second. */
+    static WorkModel Calibrate(MatrixWorkspace& workspace);
+
+    /* Predicted duration in milliseconds of a multiply */
+    double Predict(const MatrixConfig& config) const;
+
+    /* The most cubic shape whose predicted duration is within tolerance (a
+    fraction, eg 0.05) of target_ms; or the closest shape if none is. */
+    MatrixConfig Solve(double target_ms, double tolerance) const;
+
+    friend std::ostream& operator<<(std::ostream& os, const WorkModel& model) {
+      os << model.c0 << " + " << model.c1 << "*mnk + " << model.c2 << "*(mn+nk+mk) ms";
+      return os;
+    }
+
+    double c0, c1, c2;
+  };
+
+  /* Average duration in milliseconds of multiplying config, taking the best of
+  several trials to filter out interference */
+  double measure_matrix_multiply(MatrixWorkspace& workspace, const MatrixConfig& config);
+
+  /* The CPU model name from /proc/cpuinfo, used to key the calibration cache */
+  std::string cpu_model_name();
+
+  /* The default location of the calibration cache, under $XDG_CACHE_HOME or
+  $HOME/.cache */
+  std::string default_calibration_cache();
+
+  /* Looks up a model for this CPU and the active kernel in the cache file */
+  bool load_work_model(const std::string& filename, WorkModel& model);
+
+  /* Adds or replaces the model for this CPU and the active kernel in the cache
+  file.  Returns false if the file can't be written. */
+  bool save_work_model(const std::string& filename, const WorkModel& model);
+
+} // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_CALIBRATION_H_
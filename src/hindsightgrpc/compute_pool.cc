@@ -0,0 +1,87 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "compute_pool.h"
+
+namespace hindsightgrpc {
+
+ComputePool::ComputePool(int nthreads, ServiceConfig config,
+                         PriorityScheduling scheduling, int max_batch)
+    : alive(true), next_worker(0), pending(0) {
+  for (int i = 0; i < nthreads; i++) {
+    workers.push_back(std::unique_ptr<Worker>(new Worker(scheduling)));
+    create_work_engines(config, workers[i]->engines, nthreads, max_batch);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    threads.push_back(std::thread(&ComputePool::Run, this, i));
+  }
+}
+
+ComputePool::~ComputePool() {
+  Shutdown();
+}
+
+void ComputePool::Submit(ComputeTask* task, int priority) {
+  Worker* worker = workers[next_worker++ % workers.size()].get();
+  {
+    std::lock_guard<std::mutex> guard(worker->mutex);
+    worker->tasks.Push(task, priority);
+  }
+  if (pending++ == 0) {
+    // Lock to avoid racing with a thread that is about to sleep
+    std::lock_guard<std::mutex> guard(idle_mutex);
+    idle.notify_all();
+  }
+}
+
+void ComputePool::Shutdown() {
+  if (!alive.exchange(false)) return;
+  {
+    std::lock_guard<std::mutex> guard(idle_mutex);
+    idle.notify_all();
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+ComputeTask* ComputePool::Take(int id) {
+  // Oldest task from our own deque first
+  {
+    Worker* worker = workers[id].get();
+    std::lock_guard<std::mutex> guard(worker->mutex);
+    ComputeTask* task;
+    if (worker->tasks.Pop(task)) {
+      return task;
+    }
+  }
+
+  // Otherwise steal the newest task from someone else
+  for (size_t i = 1; i < workers.size(); i++) {
+    Worker* victim = workers[(id + i) % workers.size()].get();
+    std::lock_guard<std::mutex> guard(victim->mutex);
+    ComputeTask* task;
+    if (victim->tasks.PopBack(task)) {
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+void ComputePool::Run(int id) {
+  WorkEngines &engines = workers[id]->engines;
+  while (alive) {
+    ComputeTask* task = Take(id);
+    if (task != nullptr) {
+      pending--;
+      task->Compute(engines);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    idle.wait(lock, [this] { return pending > 0 || !alive; });
+  }
+}
+
+}  // namespace hindsightgrpc
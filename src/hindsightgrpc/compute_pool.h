@@ -0,0 +1,79 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_COMPUTE_POOL_H_
+#define SRC_HINDSIGHTGRPC_COMPUTE_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "priority_queue.h"
+#include "topology.h"
+#include "work_engine.h"
+
+namespace hindsightgrpc {
+
+/* A unit of work handed to the ComputePool.  Compute is called on a pool
+thread with that thread's work engines; the task is responsible for
+notifying its owner (eg via a gRPC Alarm) when it is done. */
+class ComputeTask {
+ public:
+  virtual void Compute(WorkEngines& engines) = 0;
+  virtual ~ComputeTask(){}
+};
+
+/* A pool of compute threads with per-thread work-stealing deques.
+
+Tasks are submitted round-robin onto the threads' deques.  Each thread takes
+the oldest task from its own deque, and when that is empty steals the newest
+task from another thread's deque.  Threads sleep when the whole pool is idle.
+Each thread has its own work engines, so computation never touches a handler
+thread's state.
+
+Each deque is split into priority classes, see PriorityQueue: threads take
+and steal from the more important classes first. */
+class ComputePool {
+ public:
+  /* max_batch is the largest GemmBatcher batch the threads may run, so that
+  their engines are sized for it */
+  ComputePool(int nthreads, ServiceConfig config,
+              PriorityScheduling scheduling = STRICT_PRIORITY, int max_batch = 1);
+  ~ComputePool();
+
+  /* Thread-safe; called from handler threads */
+  void Submit(ComputeTask* task, int priority = 0);
+
+  /* Stops and joins the compute threads.  Queued tasks are dropped. */
+  void Shutdown();
+
+ private:
+  struct Worker {
+    explicit Worker(PriorityScheduling scheduling) : tasks(scheduling) {}
+    std::mutex mutex;
+    PriorityQueue<ComputeTask*> tasks;
+    WorkEngines engines;
+  };
+
+  void Run(int id);
+  ComputeTask* Take(int id);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic_bool alive;
+  std::atomic_uint64_t next_worker;
+
+  // Idle threads wait for pending to become non-zero
+  std::atomic_int64_t pending;
+  std::mutex idle_mutex;
+  std::condition_variable idle;
+};
+
+}  // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_COMPUTE_POOL_H_
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "concurrency_limiter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace hindsightgrpc {
+
+// The gradient limiter starts here and adapts from there
+static const double initial_limit = 20;
+static const double min_limit = 1;
+
+// Weight of new samples in the short-term latency average
+static const double short_weight = 0.1;
+
+// The no-load latency is the minimum latency over the current and the
+// previous window of this many completions.  The minimum of so many requests
+// is rarely inflated by queueing, and forgetting old windows lets it follow
+// the service if it becomes slower, without disturbing the limit.
+static const uint64_t baseline_window = 1000;
+
+// Short-term latency may exceed the no-load latency by this factor before the
+// limit starts to shrink
+static const double latency_tolerance = 1.5;
+
+// Weight of each new estimate in the limit, to damp oscillation
+static const double smoothing = 0.2;
+
+ConcurrencyLimiter::ConcurrencyLimiter(Mode mode, int max_limit)
+    : mode_(mode), max_limit_(std::max(max_limit, 1)),
+      estimate_(mode == STATIC ? max_limit_ : std::min(initial_limit, max_limit_)),
+      limit_((int) estimate_), short_latency_(0),
+      window_min_(std::numeric_limits<double>::infinity()),
+      previous_min_(std::numeric_limits<double>::infinity()), samples_(0) {}
+
+void ConcurrencyLimiter::OnComplete(uint64_t latency_ns, int outstanding) {
+  if (mode_ == STATIC) {
+    return;
+  }
+
+  double latency = (double) latency_ns;
+  if (samples_ == 0) {
+    short_latency_ = latency;
+  } else {
+    short_latency_ += short_weight * (latency - short_latency_);
+  }
+  window_min_ = std::min(window_min_, latency);
+  double baseline_latency = std::min(window_min_, previous_min_);
+  if (++samples_ % baseline_window == 0) {
+    previous_min_ = window_min_;
+    window_min_ = std::numeric_limits<double>::infinity();
+  }
+
+  // Between 0.5 and 1: roughly the fraction of the limit that isn't queueing
+  double gradient = latency_tolerance * baseline_latency / std::max(short_latency_, 1.0);
+  gradient = std::max(0.5, std::min(1.0, gradient));
+
+  // Allow some queueing so that the limit can grow to find more capacity
+  double queue_allowance = std::sqrt(estimate_);
+  double estimate = estimate_ * gradient + queue_allowance;
+
+  // Don't grow the limit when the current one isn't being used
+  if (estimate > estimate_ && outstanding < estimate_ / 2) {
+    return;
+  }
+
+  estimate_ = (1 - smoothing) * estimate_ + smoothing * estimate;
+  estimate_ = std::max(min_limit, std::min(max_limit_, estimate_));
+  limit_ = (int) estimate_;
+}
+
+}  // namespace hindsightgrpc
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_CONCURRENCY_LIMITER_H_
+#define SRC_HINDSIGHTGRPC_CONCURRENCY_LIMITER_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace hindsightgrpc {
+
+/* Decides how many requests a handler executes concurrently.  Requests
+beyond the limit are rejected rather than queued.
+
+A STATIC limiter always admits max_limit requests.  A GRADIENT limiter adapts
+the limit to measured request latency: it compares a short-term average of
+latency against the latency seen without load, shrinking the limit when
+latency rises (queues are building) and growing it by a small allowance
+otherwise.  The limit never exceeds max_limit.  The latency without load is
+the minimum over the last two windows of completions, so that it follows the
+service if it becomes slower.
+
+Not thread-safe -- each handler owns its own.  limit() may be read from
+other threads. */
+class ConcurrencyLimiter {
+ public:
+  enum Mode { STATIC, GRADIENT };
+
+  ConcurrencyLimiter(Mode mode, int max_limit);
+
+  /* Whether to admit another request, given the number already executing */
+  bool Admit(int outstanding) const { return outstanding < limit_; }
+
+  /* Updates the limit with the latency of a completed request, which should
+  only count the time the request spent on this server.  outstanding is the
+  number of requests executing when it completed. */
+  void OnComplete(uint64_t latency_ns, int outstanding);
+
+  int limit() const { return limit_; }
+
+ private:
+  const Mode mode_;
+  const double max_limit_;
+
+  // The limit before rounding
+  double estimate_;
+  std::atomic_int limit_;
+
+  // A moving average of recent request latency, and the minimum latency in
+  // the current and the previous window, which estimate latency without load
+  double short_latency_;
+  double window_min_;
+  double previous_min_;
+  uint64_t samples_;
+};
+
+}  // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_CONCURRENCY_LIMITER_H_
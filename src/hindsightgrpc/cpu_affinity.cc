@@ -0,0 +1,85 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "cpu_affinity.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sstream>
+
+namespace hindsightgrpc {
+
+static bool parse_cpu(const std::string &s, int &cpu) {
+  if (s.empty() || s.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  cpu = atoi(s.c_str());
+  return cpu < CPU_SETSIZE;
+}
+
+bool parse_cpu_list(const std::string &list, std::vector<int> &cpus) {
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    size_t dash = range.find('-');
+    int first, last;
+    if (dash == std::string::npos) {
+      if (!parse_cpu(range, first)) return false;
+      last = first;
+    } else if (!parse_cpu(range.substr(0, dash), first) ||
+               !parse_cpu(range.substr(dash + 1), last) || last < first) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return !cpus.empty();
+}
+
+// The calling thread's affinity before it was first pinned
+static thread_local bool original_saved = false;
+static thread_local cpu_set_t original_affinity;
+
+bool pin_current_thread(int cpu) {
+  if (!original_saved) {
+    original_saved = pthread_getaffinity_np(pthread_self(), sizeof(original_affinity),
+                                            &original_affinity) == 0;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void unpin_current_thread() {
+  if (original_saved) {
+    pthread_setaffinity_np(pthread_self(), sizeof(original_affinity), &original_affinity);
+    original_saved = false;
+  }
+}
+
+int cpu_numa_node(int cpu) {
+  // The CPU's sysfs directory has a nodeN entry for its node
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR* dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return -1;
+  }
+  int node = -1;
+  while (struct dirent* entry = readdir(dir)) {
+    if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] != '\0') {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+}  // namespace hindsightgrpc
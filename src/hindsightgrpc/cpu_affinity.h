@@ -0,0 +1,30 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_CPU_AFFINITY_H_
+#define SRC_HINDSIGHTGRPC_CPU_AFFINITY_H_
+
+#include <string>
+#include <vector>
+
+namespace hindsightgrpc {
+
+/* Parses a CPU list such as "0-3,8,10-11".  Returns false if it is malformed. */
+bool parse_cpu_list(const std::string &list, std::vector<int> &cpus);
+
+/* Restricts the calling thread to the given CPU.  Returns false on failure.
+The thread's affinity before it was first pinned is saved. */
+bool pin_current_thread(int cpu);
+
+/* Restores the calling thread's affinity from before it was first pinned,
+eg the CPUs the server was started on with taskset */
+void unpin_current_thread();
+
+/* The NUMA node of a CPU, or -1 if unknown */
+int cpu_numa_node(int cpu);
+
+}  // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_CPU_AFFINITY_H_
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "gemm_batcher.h"
+
+#include <algorithm>
+
+extern "C" {
+  #include "common.h"
+}
+
+namespace hindsightgrpc {
+
+  static uint64_t matrix_key(const MatrixConfig& matrix) {
+    return ((uint64_t) matrix.m_ << 42) | ((uint64_t) matrix.n_ << 21) | (uint64_t) matrix.k_;
+  }
+
+  // Held by the timer and by running the batch
+  GemmBatch::GemmBatch(GemmBatcher* batcher, uint64_t key, const MatrixConfig& matrix,
+                       double exec_ms, int engine)
+    : batcher_(batcher), refs_(2), key(key), matrix(matrix), exec_ms(exec_ms), engine(engine) {}
+
+  void GemmBatch::Proceed(bool ok) {
+    // Not ok if the batch filled up and cancelled the timer, or on shutdown
+    if (ok) {
+      batcher_->Close(this);
+    }
+    Release();
+  }
+
+  void GemmBatch::Compute(WorkEngines& engines) {
+    // Abandoned requests are left out, as in Request::Compute
+    int count = 0;
+    for (Request* request : requests) {
+      if (!request->Abandoned()) count++;
+    }
+
+    uint64_t begin = nanos();
+    if (count > 0) {
+      // Counted as work of the request that closed the batch, if it is
+      // sampled for hardware counters
+      PerfRegion region(PERF_WORK);
+      engines[engine]->RunBatch(exec_ms, matrix, count);
+    }
+    uint64_t end = nanos();
+
+    for (size_t i = 0; i < requests.size(); i++) {
+      Request* request = requests[i];
+      request->exec_duration = end - begin;
+      request->gemm_batch_size_ = requests.size();
+      request->gemm_batch_wait_ = begin - added_at[i];
+      request->alarm_.Set(request->handler_->cq_, gpr_time_0(GPR_CLOCK_MONOTONIC), request);
+    }
+    Release();
+  }
+
+  void GemmBatch::Release() {
+    if (--refs_ == 0) {
+      delete this;
+    }
+  }
+
+  GemmBatcher::GemmBatcher(int max_batch, int max_delay_us, ComputePool* pool)
+    : max_batch(std::max(max_batch, 1)), max_delay_us(max_delay_us), pool(pool) {}
+
+  bool GemmBatcher::Batches(int engine) {
+    static const int matrix = work_engine_index("matrix");
+    return engine == matrix;
+  }
+
+  void GemmBatcher::Add(Request* request) {
+    const Route* route = request->route_;
+    uint64_t key = matrix_key(route->matrix);
+    GemmBatch* full = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      GemmBatch*& batch = open[key];
+      if (batch == nullptr) {
+        // The first request opens the window
+        batch = new GemmBatch(this, key, route->matrix, route->api->exec, route->engine);
+        batch->alarm.Set(request->handler_->cq_,
+          gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_micros(max_delay_us, GPR_TIMESPAN)),
+          static_cast<Callback*>(batch));
+      }
+      batch->requests.push_back(request);
+      batch->added_at.push_back(nanos());
+      if (batch->requests.size() >= max_batch) {
+        full = batch;
+        open.erase(key);
+      }
+    }
+    if (full != nullptr) {
+      full->alarm.Cancel();
+      Run(full);
+    }
+  }
+
+  void GemmBatcher::Close(GemmBatch* batch) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = open.find(batch->key);
+      if (it == open.end() || it->second != batch) {
+        return;
+      }
+      open.erase(it);
+    }
+    Run(batch);
+  }
+
+  void GemmBatcher::Run(GemmBatch* batch) {
+    if (pool != nullptr) {
+      int priority = 0;
+      for (Request* request : batch->requests) {
+        priority = std::max(priority, request->request_->priority());
+      }
+      pool->Submit(batch, priority);
+    } else {
+      batch->Compute(HandlerThread::current().engines);
+    }
+  }
+
+}  // namespace hindsightgrpc
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_GEMM_BATCHER_H_
+#define SRC_HINDSIGHTGRPC_GEMM_BATCHER_H_
+
+#include <grpcpp/alarm.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "compute_pool.h"
+#include "server.h"
+#include "work.h"
+#include "work_engine.h"
+
+namespace hindsightgrpc {
+  class GemmBatcher;
+
+  /* Requests for the same MatrixConfig that are computed together.  The
+  batch is also the callback for its window's timer, and a ComputeTask so
+  that it can run on the compute pool.  It is deleted once it has both run
+  and had its timer delivered. */
+  class GemmBatch : public Callback, public ComputeTask {
+    public:
+      GemmBatch(GemmBatcher* batcher, uint64_t key, const MatrixConfig& matrix,
+                double exec_ms, int engine);
+
+      /* The batch's window closed */
+      void Proceed(bool ok);
+
+      /* Runs the batch as one GEMM and resumes its requests */
+      void Compute(WorkEngines& engines);
+
+    private:
+      void Release();
+
+      GemmBatcher* batcher_;
+      std::atomic_int refs_;
+
+    public:
+      // The batch's MatrixConfig and its key in GemmBatcher::open
+      uint64_t key;
+      MatrixConfig matrix;
+      double exec_ms;
+      int engine;
+
+      // The requests, and when each was added
+      std::vector<Request*> requests;
+      std::vector<uint64_t> added_at;
+
+      grpc::Alarm alarm;
+  };
+
+  /* An optional stage in front of the matrix engine that models an
+  inference-style batching service.  Requests that use the matrix engine are
+  held for up to max_delay_us, and requests with the same MatrixConfig that
+  arrive in that window are computed together, up to max_batch of them, as
+  one GEMM with their left-hand matrices stacked.  Each request is then
+  resumed in the COMPUTE state on its handler's CQ.
+
+  Batches run on the compute pool if there is one, and otherwise on the
+  handler thread that closes them.  Thread-safe. */
+  class GemmBatcher {
+    public:
+      GemmBatcher(int max_batch, int max_delay_us, ComputePool* pool);
+
+      /* Whether requests that use the engine are batched */
+      static bool Batches(int engine);
+
+      /* Adds a request in the COMPUTE state to the open batch for its
+      MatrixConfig, opening one if there is none */
+      void Add(Request* request);
+
+      /* Closes batch if it is still open; called when its timer fires */
+      void Close(GemmBatch* batch);
+
+    private:
+      void Run(GemmBatch* batch);
+
+      const size_t max_batch;
+      const int max_delay_us;
+      ComputePool* pool;
+
+      // The open batch of each MatrixConfig
+      std::mutex mutex;
+      std::map<uint64_t, GemmBatch*> open;
+  };
+
+} // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_GEMM_BATCHER_H_
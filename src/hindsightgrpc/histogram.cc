@@ -0,0 +1,96 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "histogram.h"
+
+#include <algorithm>
+
+namespace hindsightgrpc {
+
+static const int sub_buckets = 1 << LatencyHistogram::sub_bits;
+
+LatencyHistogram::LatencyHistogram() : total_(0) {
+  for (int i = 0; i < buckets; i++) {
+    counts_[i] = 0;
+  }
+}
+
+// Latencies below sub_buckets have a bucket each.  Above that, a latency
+// whose highest bit is e goes in one of the sub_buckets buckets for e, picked
+// by the sub_bits bits below its highest.
+int LatencyHistogram::Bucket(uint64_t latency_ns) {
+  if (latency_ns < (uint64_t) sub_buckets) {
+    return (int) latency_ns;
+  }
+  int e = 63 - __builtin_clzll(latency_ns);
+  if (e >= max_bits) {
+    return buckets - 1;
+  }
+  int shift = e - sub_bits;
+  return (shift << sub_bits) + (int) (latency_ns >> shift);
+}
+
+uint64_t LatencyHistogram::LowerBound(int bucket) {
+  if (bucket < sub_buckets) {
+    return bucket;
+  }
+  int shift = (bucket >> sub_bits) - 1;
+  uint64_t sub = (bucket & (sub_buckets - 1)) + sub_buckets;
+  return sub << shift;
+}
+
+HistogramSnapshot::HistogramSnapshot() : count_(0), total_(0) {
+  std::fill(counts_, counts_ + LatencyHistogram::buckets, 0);
+}
+
+void HistogramSnapshot::Merge(const LatencyHistogram& histogram) {
+  for (int i = 0; i < LatencyHistogram::buckets; i++) {
+    uint64_t count = histogram.counts_[i].load(std::memory_order_relaxed);
+    counts_[i] += count;
+    count_ += count;
+  }
+  total_ += histogram.total_.load(std::memory_order_relaxed);
+}
+
+HistogramSnapshot HistogramSnapshot::Since(const HistogramSnapshot& earlier) const {
+  HistogramSnapshot interval;
+  for (int i = 0; i < LatencyHistogram::buckets; i++) {
+    interval.counts_[i] = counts_[i] - earlier.counts_[i];
+  }
+  interval.count_ = count_ - earlier.count_;
+  interval.total_ = total_ - earlier.total_;
+  return interval;
+}
+
+uint64_t HistogramSnapshot::Percentile(double p) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  uint64_t rank = std::max<uint64_t>(1, (uint64_t) (p / 100 * count_ + 0.5));
+  uint64_t seen = 0;
+  int last = LatencyHistogram::buckets - 1;
+  for (int i = 0; i < LatencyHistogram::buckets; i++) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      last = i;
+      break;
+    }
+  }
+  uint64_t lower = LatencyHistogram::LowerBound(last);
+  uint64_t upper = LatencyHistogram::LowerBound(last + 1);
+  return lower + (upper - lower) / 2;
+}
+
+const char* request_stage_name(int stage) {
+  switch (stage) {
+    case ADMISSION_STAGE: return "admission";
+    case COMPUTE_STAGE: return "compute";
+    case CHILDREN_STAGE: return "children";
+    case FINISH_STAGE: return "finish";
+    case END_TO_END: return "total";
+    default: return "unknown";
+  }
+}
+
+}  // namespace hindsightgrpc
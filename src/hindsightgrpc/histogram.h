@@ -0,0 +1,97 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_HISTOGRAM_H_
+#define SRC_HINDSIGHTGRPC_HISTOGRAM_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace hindsightgrpc {
+
+/* A histogram of latencies in nanoseconds with log-linear buckets: each
+power of two is split into 16 equal buckets, so a bucket is within 1/16th of
+the values in it.  Latencies of 2^40 ns (about 18 minutes) or more all go in
+the last bucket.
+
+Record is lock-free and may be called from several threads at once.  Other
+threads may take a HistogramSnapshot at any time without locking; the
+snapshot may miss latencies being recorded as it is taken. */
+class LatencyHistogram {
+ public:
+  static const int sub_bits = 4;
+  static const int max_bits = 40;
+  static const int buckets = (max_bits - sub_bits + 1) << sub_bits;
+
+  LatencyHistogram();
+
+  void Record(uint64_t latency_ns) {
+    counts_[Bucket(latency_ns)].fetch_add(1, std::memory_order_relaxed);
+    total_.fetch_add(latency_ns, std::memory_order_relaxed);
+  }
+
+  static int Bucket(uint64_t latency_ns);
+
+  /* The smallest latency in bucket */
+  static uint64_t LowerBound(int bucket);
+
+ private:
+  friend class HistogramSnapshot;
+
+  std::atomic_uint64_t counts_[buckets];
+  std::atomic_uint64_t total_;
+};
+
+/* A point-in-time copy of one or more LatencyHistograms */
+class HistogramSnapshot {
+ public:
+  HistogramSnapshot();
+
+  /* Adds the histogram's current counts to the snapshot */
+  void Merge(const LatencyHistogram& histogram);
+
+  /* The latencies recorded since an earlier snapshot of the same
+  histograms */
+  HistogramSnapshot Since(const HistogramSnapshot& earlier) const;
+
+  uint64_t count() const { return count_; }
+  uint64_t total() const { return total_; }
+  uint64_t count(int bucket) const { return counts_[bucket]; }
+  uint64_t Mean() const { return count_ == 0 ? 0 : total_ / count_; }
+
+  /* The latency at percentile p (0 to 100), as the midpoint of its bucket,
+  or 0 if the snapshot is empty */
+  uint64_t Percentile(double p) const;
+
+ private:
+  uint64_t counts_[LatencyHistogram::buckets];
+  uint64_t count_;
+  uint64_t total_;
+};
+
+/* The stages of a request that the server measures, from when gRPC hands it
+to a handler */
+enum RequestStage {
+  ADMISSION_STAGE,  // until it is admitted, including time queued
+  COMPUTE_STAGE,    // its computation, including time queued for it
+  CHILDREN_STAGE,   // until its child calls are done
+  FINISH_STAGE,     // sending the response
+  END_TO_END,       // all of the above
+  REQUEST_STAGES
+};
+
+const char* request_stage_name(int stage);
+
+/* A handler's latency histograms for the stages of requests to one API,
+padded so that no other data shares their cache lines */
+struct StageHistograms {
+  char pad_before_[64];
+  LatencyHistogram stages[REQUEST_STAGES];
+  char pad_after_[64];
+};
+
+}  // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_HISTOGRAM_H_
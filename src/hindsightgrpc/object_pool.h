@@ -0,0 +1,57 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_OBJECT_POOL_H_
+#define SRC_HINDSIGHTGRPC_OBJECT_POOL_H_
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace hindsightgrpc {
+
+/* A free list of recycled objects.  Objects are only allocated when the free
+list is empty, so the pool grows to the peak number of objects in use and
+then stops allocating.  Released objects must already have been reset by
+their owner.
+
+Not thread-safe -- each handler thread owns its own pools. */
+template <typename T>
+class ObjectPool {
+ public:
+  ObjectPool() : allocated_(0) {}
+  ~ObjectPool() {
+    for (T* obj : free_) {
+      delete obj;
+    }
+  }
+
+  /* Returns a recycled object, or a new T(args...) if there are none */
+  template <typename... Args>
+  T* Acquire(Args&&... args) {
+    if (free_.empty()) {
+      allocated_++;
+      return new T(std::forward<Args>(args)...);
+    }
+    T* obj = free_.back();
+    free_.pop_back();
+    return obj;
+  }
+
+  void Release(T* obj) {
+    free_.push_back(obj);
+  }
+
+  /* The number of objects ever allocated by this pool */
+  size_t allocated() const { return allocated_; }
+
+ private:
+  std::vector<T*> free_;
+  size_t allocated_;
+};
+
+}  // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_OBJECT_POOL_H_
@@ -0,0 +1,174 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "perf_counters.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace hindsightgrpc {
+
+const char* perf_value_name(int value) {
+  switch (value) {
+    case PERF_CYCLES: return "cycles";
+    case PERF_INSTRUCTIONS: return "instructions";
+    case PERF_LLC_MISSES: return "llc_misses";
+    case PERF_BRANCH_MISSES: return "branch_misses";
+    case PERF_CPU_NS: return "cpu_ns";
+    default: return "unknown";
+  }
+}
+
+const char* perf_category_name(int category) {
+  switch (category) {
+    case PERF_TRACING: return "tracing";
+    case PERF_WORK: return "work";
+    case PERF_GRPC: return "grpc";
+    default: return "unknown";
+  }
+}
+
+PerfSample::PerfSample() {
+  std::fill(values, values + PERF_VALUES, 0);
+}
+
+void PerfSample::AddSince(const PerfSample& end, const PerfSample& begin) {
+  for (int i = 0; i < PERF_VALUES; i++) {
+    if (end.values[i] > begin.values[i]) {
+      values[i] += end.values[i] - begin.values[i];
+    }
+  }
+}
+
+void PerfSample::Subtract(const PerfSample& other) {
+  for (int i = 0; i < PERF_VALUES; i++) {
+    values[i] -= std::min(values[i], other.values[i]);
+  }
+}
+
+// The hardware event behind each counter, in PerfValue order
+static const uint64_t perf_events[PERF_CPU_NS] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_BRANCH_MISSES
+};
+
+thread_local PerfCounters* PerfCounters::current_ = nullptr;
+
+PerfCounters::PerfCounters() {
+  std::fill(fds_, fds_ + PERF_CPU_NS, -1);
+}
+
+PerfCounters::~PerfCounters() {
+  if (current_ == this) {
+    current_ = nullptr;
+  }
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+// The first counter leads the group, and the group is read in one go.  Like
+// the thread's CPU time, the counters include time spent in the kernel on
+// the thread's behalf, eg in gRPC's syscalls.
+bool PerfCounters::Open() {
+  current_ = this;
+  for (int i = 0; i < PERF_CPU_NS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = perf_events[i];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    attr.disabled = i == 0;
+    fds_[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds_[0], 0);
+    if (fds_[i] < 0) {
+      for (int j = 0; j <= i; j++) {
+        if (fds_[j] >= 0) {
+          close(fds_[j]);
+        }
+        fds_[j] = -1;
+      }
+      return false;
+    }
+  }
+  ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return true;
+}
+
+void PerfCounters::Read(PerfSample& sample) const {
+  if (fds_[0] >= 0) {
+    uint64_t group[1 + PERF_CPU_NS];
+    if (read(fds_[0], group, sizeof(group)) == (ssize_t) sizeof(group)) {
+      std::copy(group + 1, group + 1 + PERF_CPU_NS, sample.values);
+    }
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  sample.values[PERF_CPU_NS] = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+PerfTotals::PerfTotals() : requests(0) {
+  for (int c = 0; c < PERF_CATEGORIES; c++) {
+    for (int v = 0; v < PERF_VALUES; v++) {
+      values[c][v] = 0;
+    }
+  }
+}
+
+void PerfTotals::Add(int category, const PerfSample& sample) {
+  for (int v = 0; v < PERF_VALUES; v++) {
+    values[category][v].fetch_add(sample.values[v], std::memory_order_relaxed);
+  }
+}
+
+thread_local PerfStage* PerfStage::current_ = nullptr;
+
+PerfStage::PerfStage(bool sampled, PerfTotals* totals) :
+    active_(sampled && PerfCounters::current() != nullptr), totals_(totals), outer_(current_) {
+  if (active_) {
+    current_ = this;
+    PerfCounters::current()->Read(begin_);
+  }
+}
+
+PerfStage::~PerfStage() {
+  if (!active_) {
+    return;
+  }
+  PerfSample end;
+  PerfCounters::current()->Read(end);
+  current_ = outer_;
+
+  PerfSample total;
+  total.AddSince(end, begin_);
+  if (outer_ != nullptr) {
+    outer_->nested_.AddSince(end, begin_);
+  }
+  if (totals_ == nullptr) {
+    return;
+  }
+
+  PerfSample rest = total;
+  rest.Subtract(nested_);
+  for (int c = 0; c < PERF_CATEGORIES; c++) {
+    if (c != PERF_GRPC) {
+      totals_->Add(c, regions_[c]);
+      rest.Subtract(regions_[c]);
+    }
+  }
+  totals_->Add(PERF_GRPC, rest);
+}
+
+}  // namespace hindsightgrpc
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_PERF_COUNTERS_H_
+#define SRC_HINDSIGHTGRPC_PERF_COUNTERS_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace hindsightgrpc {
+
+/* What a PerfSample measures */
+enum PerfValue {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_CPU_NS,  // thread CPU time, from CLOCK_THREAD_CPUTIME_ID
+  PERF_VALUES
+};
+
+/* What a request's time on a handler thread is spent on */
+enum PerfCategory {
+  PERF_TRACING,  // HINDSIGHT and OPENTELEMETRY blocks
+  PERF_WORK,     // the API's work engine
+  PERF_GRPC,     // everything else: gRPC, protobuf, and the server's own logic
+  PERF_CATEGORIES
+};
+
+const char* perf_value_name(int value);
+const char* perf_category_name(int category);
+
+/* The calling thread's counters at some moment, or the difference between
+two such moments */
+struct PerfSample {
+  PerfSample();
+
+  uint64_t values[PERF_VALUES];
+
+  /* Adds end - begin, leaving out counters that went backwards */
+  void AddSince(const PerfSample& end, const PerfSample& begin);
+  /* Subtracts other, stopping at 0 */
+  void Subtract(const PerfSample& other);
+};
+
+/* Hardware counters of the calling thread, opened as one perf_event_open
+group so that they count over the same periods.  The counters and the CPU
+time both count user and kernel mode.  CPU time is read whether or not the
+counters could be opened.
+
+Not thread-safe -- each handler thread opens its own. */
+class PerfCounters {
+ public:
+  PerfCounters();
+  ~PerfCounters();
+
+  /* Opens the counters for the calling thread and makes them the thread's
+  current counters.  Returns false if the kernel refuses, eg because
+  kernel.perf_event_paranoid is above 1, in which case only CPU time is
+  measured. */
+  bool Open();
+
+  /* The calling thread's counters, if it opened any */
+  static PerfCounters* current() { return current_; }
+
+  void Read(PerfSample& sample) const;
+
+ private:
+  int fds_[PERF_CPU_NS];
+  static thread_local PerfCounters* current_;
+};
+
+/* A handler's totals for the sampled requests to one API, padded so that no
+other data shares their cache lines.  Written by the handler's threads. */
+struct PerfTotals {
+  PerfTotals();
+
+  void Add(int category, const PerfSample& sample);
+
+  char pad_before_[64];
+  std::atomic_uint64_t requests;
+  std::atomic_uint64_t values[PERF_CATEGORIES][PERF_VALUES];
+  char pad_after_[64];
+};
+
+/* Measures one stage of a sampled request on a handler thread, eg one call
+to Request::Proceed, and adds it to totals when it ends.  PerfRegions within
+the stage are attributed to their category, and the rest to PERF_GRPC.
+
+An inactive stage, for requests that aren't sampled or threads without
+counters, measures nothing, and regions within it are attributed to any
+stage it is nested in. */
+class PerfStage {
+ public:
+  PerfStage(bool sampled, PerfTotals* totals);
+  ~PerfStage();
+
+  /* Sets the totals, for stages that find out their API part way through */
+  void SetTotals(PerfTotals* totals) { totals_ = totals; }
+
+  static PerfStage* current() { return current_; }
+
+ private:
+  friend class PerfRegion;
+
+  bool active_;
+  PerfTotals* totals_;
+  PerfStage* outer_;
+  PerfSample begin_;
+  PerfSample regions_[PERF_CATEGORIES];
+  // Measured by nested stages, and so not part of this one
+  PerfSample nested_;
+
+  static thread_local PerfStage* current_;
+};
+
+/* Attributes the work done during its lifetime to a category of the
+current stage, if there is one */
+class PerfRegion {
+ public:
+  explicit PerfRegion(int category) : stage_(PerfStage::current_), category_(category) {
+    if (stage_ != nullptr) {
+      PerfCounters::current()->Read(begin_);
+    }
+  }
+  ~PerfRegion() {
+    if (stage_ != nullptr) {
+      PerfSample end;
+      PerfCounters::current()->Read(end);
+      stage_->regions_[category_].AddSince(end, begin_);
+    }
+  }
+
+ private:
+  PerfStage* stage_;
+  int category_;
+  PerfSample begin_;
+};
+
+}  // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_PERF_COUNTERS_H_
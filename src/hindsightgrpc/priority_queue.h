@@ -0,0 +1,115 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_PRIORITY_QUEUE_H_
+#define SRC_HINDSIGHTGRPC_PRIORITY_QUEUE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+
+namespace hindsightgrpc {
+
+/* How a PriorityQueue picks the class to take from next */
+enum PriorityScheduling {
+  STRICT_PRIORITY,  // always the most important
+  WEIGHTED_FAIR     // in proportion to priority+1
+};
+
+/* FIFO queues for a few priority classes, from 0 (least important) to
+classes-1.  Priorities outside that range are clamped into it.
+
+A STRICT_PRIORITY queue always takes from the most important non-empty
+class.  A WEIGHTED_FAIR queue takes from the non-empty classes in proportion
+to priority+1, with smooth weighted round robin, so that less important
+classes are slowed down rather than starved.
+
+Not thread-safe -- owners lock around it. */
+template <typename T>
+class PriorityQueue {
+ public:
+  static const int classes = 4;
+
+  explicit PriorityQueue(PriorityScheduling mode = STRICT_PRIORITY) : mode_(mode), size_(0) {
+    std::fill(credit_, credit_ + classes, 0);
+  }
+
+  static int Class(int priority) {
+    return std::max(0, std::min(classes - 1, priority));
+  }
+
+  void Push(const T& item, int priority) {
+    queues_[Class(priority)].push_back(item);
+    size_++;
+  }
+
+  /* Takes the next item, oldest first within its class */
+  bool Pop(T& item) {
+    int c = Next();
+    if (c < 0) return false;
+    item = queues_[c].front();
+    queues_[c].pop_front();
+    size_--;
+    return true;
+  }
+
+  /* Takes the next item, newest first within its class, eg for stealing */
+  bool PopBack(T& item) {
+    int c = Next();
+    if (c < 0) return false;
+    item = queues_[c].back();
+    queues_[c].pop_back();
+    size_--;
+    return true;
+  }
+
+  /* Takes the newest item of the least important class below priority, to
+  shed it in favour of a more important one */
+  bool PopLeastImportant(T& item, int priority) {
+    for (int c = 0; c < Class(priority); c++) {
+      if (!queues_[c].empty()) {
+        item = queues_[c].back();
+        queues_[c].pop_back();
+        size_--;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+ private:
+  // The class to take from next, or -1 if all are empty
+  int Next() {
+    if (size_ == 0) return -1;
+    if (mode_ == STRICT_PRIORITY) {
+      for (int c = classes - 1; c >= 0; c--) {
+        if (!queues_[c].empty()) return c;
+      }
+      return -1;
+    }
+    int best = -1;
+    int total = 0;
+    for (int c = 0; c < classes; c++) {
+      if (queues_[c].empty()) continue;
+      credit_[c] += c + 1;
+      total += c + 1;
+      if (best < 0 || credit_[c] > credit_[best]) best = c;
+    }
+    credit_[best] -= total;
+    return best;
+  }
+
+  const PriorityScheduling mode_;
+  std::deque<T> queues_[classes];
+  int credit_[classes];
+  size_t size_;
+};
+
+}  // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_PRIORITY_QUEUE_H_
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_RANDOM_H_
+#define SRC_HINDSIGHTGRPC_RANDOM_H_
+
+#include <cstdint>
+#include <random>
+
+namespace hindsightgrpc {
+
+  /* The splitmix64 finalizer.  Used to derive independent seeds and keys from
+  related values such as seed + thread id. */
+  inline uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  /* A seed from std::random_device, for when no seed is given */
+  inline uint64_t random_seed() {
+    std::random_device rd;
+    return ((uint64_t) rd() << 32) ^ rd();
+  }
+
+  /* Converts a probability into a threshold for Xoshiro256::Next32, which is
+  below the threshold with probability p */
+  inline uint64_t probability_threshold(double p) {
+    if (p <= 0) return 0;
+    if (p >= 1) return 1ULL << 32;
+    return (uint64_t) (p * 4294967296.0);
+  }
+
+  /* The xoshiro256** generator.  Much faster than libc rand() and, unlike
+  rand(), has no shared state, so each handler and client thread owns one.
+  Satisfies UniformRandomBitGenerator, so it works with <random>
+  distributions.  Not thread-safe. */
+  class Xoshiro256 {
+    public:
+    typedef uint64_t result_type;
+
+    explicit Xoshiro256(uint64_t seed = 0) { Seed(seed); }
+
+    void Seed(uint64_t seed) {
+      for (int i = 0; i < 4; i++) {
+        seed = mix64(seed);
+        s_[i] = seed;
+      }
+    }
+
+    uint64_t Next() {
+      uint64_t result = rotl(s_[1] * 5, 7) * 9;
+      uint64_t t = s_[1] << 17;
+      s_[2] ^= s_[0];
+      s_[3] ^= s_[1];
+      s_[1] ^= s_[2];
+      s_[0] ^= s_[3];
+      s_[2] ^= t;
+      s_[3] = rotl(s_[3], 45);
+      return result;
+    }
+
+    /* The top 32 bits of Next(), to compare against probability_threshold */
+    uint32_t Next32() { return Next() >> 32; }
+
+    /* Uniform in [0, n), for n < 2^32 */
+    uint32_t Below(uint32_t n) { return ((uint64_t) Next32() * n) >> 32; }
+
+    /* Uniform in [0, 1) */
+    double Uniform() { return (Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return UINT64_MAX; }
+    uint64_t operator()() { return Next(); }
+
+    private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    uint64_t s_[4];
+  };
+
+} // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_RANDOM_H_
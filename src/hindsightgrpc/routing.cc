@@ -0,0 +1,124 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "routing.h"
+
+#include <algorithm>
+
+#include "random.h"
+#include "server.h"
+#include "weighted_schedule.h"
+#include "work_engine.h"
+
+namespace hindsightgrpc {
+
+    static std::vector<int> target_schedule(const std::vector<RouteTarget>& targets) {
+        std::vector<int> weights;
+        for (auto &target : targets) {
+            weights.push_back(target.outcall->weight);
+        }
+        return weighted_schedule(weights);
+    }
+
+    void RoutingTable::Compile(ServiceConfig& config, ServerImpl* server, int shard) {
+        routes.clear();
+        routes.resize(config.get_apis().size());
+        for (auto &p : config.get_apis()) {
+            API& api = config.get_api(p.first);
+            Route& route = routes[api.id - 1];
+            route.api = &api;
+            route.matrix = config.get_matrix_config(p.first);
+            route.engine = work_engine_index(api.engine);
+
+            for (auto &child : api.children) {
+                RouteCall call;
+                call.threshold = probability_threshold(child.probability / 100.0);
+                if (child.subcalls.size() > 0) {
+                    for (auto &subcall : child.subcalls) {
+                        call.targets.push_back({&subcall, server->GetClient(subcall.server_addr, shard)});
+                    }
+                } else {
+                    call.targets.push_back({&child, server->GetClient(child.server_addr, shard)});
+                }
+                call.schedule = target_schedule(call.targets);
+                call.cursor.reset(new std::atomic_uint64_t(0));
+                call.hedge_delay_ns = 0;
+                call.hedge_percentile = 0;
+                if (call.targets.size() > 1) {
+                    call.hedge_delay_ns = (uint64_t) (child.hedge_delay * 1000000);
+                    call.hedge_percentile = child.hedge_percentile;
+                }
+                route.calls.push_back(std::move(call));
+            }
+        }
+    }
+
+    // A replica's expected cost for one more call: its average latency scaled
+    // by the calls already queued on it.  Replicas without a latency yet cost
+    // nothing, so that they get tried.
+    static uint64_t replica_cost(const ChildClient* client) {
+        return (uint64_t) (client->outstanding + 1) * client->latency_ewma;
+    }
+
+    const RouteTarget* RouteCall::Pick(Xoshiro256& rng, ReplicaSelection selection) const {
+        size_t n = targets.size();
+        if (n == 1) {
+            return &targets[0];
+        }
+        switch (selection) {
+            case POWER_OF_TWO: {
+                size_t a = rng.Below(n);
+                size_t b = rng.Below(n - 1);
+                if (b >= a) b++;
+                return replica_cost(targets[b].client) < replica_cost(targets[a].client) ? &targets[b] : &targets[a];
+            }
+            case LEAST_OUTSTANDING: {
+                // Start the scan at a random replica so that ties are spread out
+                size_t start = rng.Below(n);
+                const RouteTarget* best = &targets[start];
+                for (size_t i = 1; i < n; i++) {
+                    const RouteTarget* target = &targets[(start + i) % n];
+                    if (target->client->outstanding < best->client->outstanding) {
+                        best = target;
+                    }
+                }
+                return best;
+            }
+            case WEIGHTED_ROUND_ROBIN:
+                return &targets[schedule[(*cursor)++ % schedule.size()]];
+            default:
+                return &targets[rng.Below(n)];
+        }
+    }
+
+    // A latency percentile needs some history; until then, and if there is no
+    // percentile, use the fixed delay
+    uint64_t RouteCall::HedgeDelay(const RouteTarget* primary) const {
+        if (hedge_percentile > 0) {
+            uint64_t latency = primary->client->LatencyPercentile(hedge_percentile);
+            if (latency > 0) return latency;
+        }
+        return hedge_delay_ns;
+    }
+
+    const RouteTarget* RouteCall::PickHedge(Xoshiro256& rng, const RouteTarget* primary) const {
+        size_t i = rng.Below(targets.size() - 1);
+        if (i >= (size_t) (primary - &targets[0])) i++;
+        return &targets[i];
+    }
+
+    // The caller's topology file may not match ours, so an id is only trusted
+    // if it names the same API; otherwise fall back to the name
+    const Route* RoutingTable::Lookup(int api_id, const std::string& api_name) const {
+        if (api_id > 0 && (size_t) api_id <= routes.size()) {
+            const Route& route = routes[api_id - 1];
+            if (route.api->name == api_name) return &route;
+        }
+        for (auto &route : routes) {
+            if (route.api->name == api_name) return &route;
+        }
+        return nullptr;
+    }
+
+}  // namespace hindsightgrpc
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_ROUTING_H_
+#define SRC_HINDSIGHTGRPC_ROUTING_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "random.h"
+#include "topology.h"
+#include "work.h"
+
+namespace hindsightgrpc {
+  class ChildClient;
+  class ServerImpl;
+
+  /* One instance of a child service that an outcall can go to */
+  struct RouteTarget {
+    Outcall* outcall;  // the instance's address and breadcrumb
+    ChildClient* client;
+  };
+
+  /* How an outcall picks one of several instances of its service */
+  enum ReplicaSelection {
+    RANDOM_REPLICA,       // uniformly at random
+    POWER_OF_TWO,         // the less loaded of two picked at random
+    LEAST_OUTSTANDING,    // the one with the fewest outstanding calls
+    WEIGHTED_ROUND_ROBIN  // in turn, in proportion to the instances' weights
+  };
+
+  /* An outcall of an API */
+  struct RouteCall {
+    uint64_t threshold;  // the outcall is made if Next32() < threshold
+    std::vector<RouteTarget> targets;
+
+    // For weighted round robin: indexes into targets, each appearing in
+    // proportion to its weight and spread out, and the next position
+    std::vector<int> schedule;
+    std::unique_ptr<std::atomic_uint64_t> cursor;
+
+    // Hedging, if there are several targets; see Outcall::hedge_delay
+    uint64_t hedge_delay_ns;
+    double hedge_percentile;
+
+    /* Picks one of the targets */
+    const RouteTarget* Pick(Xoshiro256& rng, ReplicaSelection selection) const;
+
+    /* How long to wait for a call to primary before hedging it, in
+    nanoseconds, or 0 not to hedge */
+    uint64_t HedgeDelay(const RouteTarget* primary) const;
+
+    /* Picks a target other than primary for a hedged call */
+    const RouteTarget* PickHedge(Xoshiro256& rng, const RouteTarget* primary) const;
+  };
+
+  /* An API of the service */
+  struct Route {
+    API* api;
+    MatrixConfig matrix;
+    int engine;  // index into WorkEngines
+    std::vector<RouteCall> calls;
+  };
+
+  /* The service's APIs compiled into a flat table indexed by API::id, with
+  each outcall resolved to its ChildClient and its probability turned into a
+  threshold for Xoshiro256::Next32.  Dispatching a request that carries an api_id does
+  no string comparisons, map lookups or allocation.
+
+  Compiled once at startup, after the matrix configs are final; read-only
+  afterwards and so safe to share between handlers.  In sharded mode each
+  handler compiles its own, with clients of its own shard. */
+  class RoutingTable {
+    public:
+      void Compile(ServiceConfig& config, ServerImpl* server, int shard = -1);
+
+      /* Finds the route by api_id if it is set and names api_name, otherwise
+      by name.  Returns nullptr if the API is unknown. */
+      const Route* Lookup(int api_id, const std::string& api_name) const;
+
+    private:
+      std::vector<Route> routes;
+  };
+
+} // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_ROUTING_H_
@@ -7,6 +7,7 @@
 #include <grpc/support/log.h>
 #include <grpcpp/grpcpp.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <memory>
@@ -14,11 +15,20 @@
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <new>
+
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <json.hpp>
 
 #include "topology.h"
+#include "cpu_affinity.h"
+#include "gemm_batcher.h"
 #include "../tracing/grpc_propagation.h"
+#include "../tracing/otel_context.h"
 
 #include "opentelemetry/trace/scope.h"
 #include "opentelemetry/trace/span_startoptions.h"
@@ -57,11 +67,11 @@ namespace detail = opentelemetry::trace::propagation::detail;
 
 // Hindsight is enabled or disabled based on command-line arguments
 bool hindsight_enabled = false;
-#define HINDSIGHT(x) {if (hindsight_enabled) {x}}
+#define HINDSIGHT(x) {if (hindsight_enabled) {hindsightgrpc::TracerTimer tracer_timer_; x}}
 
 // Opentelemetry is enabled or disabled based on command-line arguments
 bool opentelemetry_enabled = false;
-#define OPENTELEMETRY(x) {if (opentelemetry_enabled) {x}}
+#define OPENTELEMETRY(x) {if (opentelemetry_enabled) {hindsightgrpc::TracerTimer tracer_timer_; x}}
 
 // Request debugging is specified as an RPC argument
 //   so this macro is actually always-on
@@ -70,6 +80,40 @@ bool opentelemetry_enabled = false;
 std::atomic<int64_t> TRIGGER{1};
 namespace hindsightgrpc {
 
+// The span ids of a hedged call's duplicate are offset from the original's
+static const int hedge_span_offset = 5000;
+
+// The counters of the handler whose thread this is, if it is one
+static thread_local HandlerCounters* thread_counters = nullptr;
+
+// Every tracer_sample'th tracing block on a handler thread is timed
+static const int tracer_sample = 64;
+static thread_local int tracer_countdown = tracer_sample;
+
+/* Estimates the time spent in HINDSIGHT and OPENTELEMETRY blocks, by timing
+a sample of them, so that timing costs little more than the blocks do.
+Tracing that happens outside the blocks, eg ending OpenTelemetry scopes,
+isn't counted.  The blocks are also the PERF_TRACING regions of requests
+sampled for hardware counters. */
+class TracerTimer {
+ public:
+  TracerTimer() : begin_(0), region_(PERF_TRACING) {
+    if (thread_counters != nullptr && --tracer_countdown == 0) {
+      tracer_countdown = tracer_sample;
+      begin_ = nanos();
+    }
+  }
+  ~TracerTimer() {
+    if (begin_ != 0) {
+      thread_counters->tracing_ns += (nanos() - begin_) * tracer_sample;
+    }
+  }
+
+ private:
+  uint64_t begin_;
+  PerfRegion region_;
+};
+
 // Used by command-line to set hindsight tracing on or off
 void set_hindsight_enabled(bool is_enabled) {
   hindsight_enabled = is_enabled;
@@ -83,7 +127,15 @@ void set_opentelemetry_enabled(bool is_enabled) {
 ServerImpl::ServerImpl(ServiceConfig config,
                        std::map<std::string, AddressInfo> addresses,
                        bool nocompute, std::map<int, float> triggers,
-                       int instance_id, int max_outstanding_requests)
+                       int instance_id, int max_outstanding_requests,
+                       int compute_threads, bool batch_children,
+                       int channels_per_client, int channel_selection,
+                       uint64_t seed, bool deterministic_fanout,
+                       int limiter_mode, int cq_threads, int accept_depth,
+                       int busy_poll_us, std::vector<int> cpus, bool sharded,
+                       int replica_selection, int child_limit, int child_queue,
+                       int admission_queue, int priority_scheduling,
+                       int gemm_batch, int gemm_batch_delay_us, int perf_sample)
     : alive(true),
       clients(),
       config(config),
@@ -91,25 +143,38 @@ ServerImpl::ServerImpl(ServiceConfig config,
       nocompute_(nocompute),
       instance_id(instance_id),
       max_outstanding_requests(max_outstanding_requests),
-      awaiting(0),
-      processing(0),
-      awaitingchildren(0),
-      finishing(0),
-      completed(0)
+      limiter_mode(limiter_mode),
+      admission_queue(admission_queue),
+      priority_scheduling((PriorityScheduling) priority_scheduling),
+      cq_threads(cq_threads),
+      accept_depth(accept_depth),
+      busy_poll_us(busy_poll_us),
+      cpus(cpus),
+      sharded(sharded),
+      compute_threads(compute_threads),
+      compute_pool(),
+      work_threads(1),
+      gemm_batch(gemm_batch),
+      gemm_batch_delay_us(gemm_batch_delay_us),
+      gemm_batcher(),
+      perf_sample(perf_sample),
+      perf_threads(0),
+      batch_children(batch_children),
+      channels_per_client(channels_per_client),
+      channel_selection(channel_selection),
+      replica_selection((ReplicaSelection) replica_selection),
+      child_limit(child_limit),
+      child_queue(child_queue),
+      seed(seed),
+      deterministic_fanout(deterministic_fanout)
        {
   for (auto &p : triggers) {
     // trigger probabilities are typically small (e.g. 0.1, 0.01) so
     // we don't use, e.g. rand() % p to decide to trigger. instead we
-    // use rand() < RAND_MAX * p
+    // trigger if the handler's rng.Next32() < 2^32 * p
     int queue_id = p.first;
     float trigger_probability = p.second;
-    uint64_t trigger_below;
-    if (trigger_probability <= 0) trigger_below = 0;
-    else if (trigger_probability >= 1) trigger_below = UINT64_MAX;
-    else {
-      trigger_below = RAND_MAX / (uint64_t) round(1.0/trigger_probability);
-    }
-    this->triggers[queue_id] = trigger_below;
+    this->triggers[queue_id] = probability_threshold(trigger_probability);
   }
 }
 
@@ -126,8 +191,17 @@ void ServerImpl::Run(int nhandlers, bool debug) {
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   builder.RegisterService(&service_);
   for (int i = 0; i < nhandlers; i++) {
+    // Allocate each handler's completion queue from its first thread's CPU,
+    // so that first touch places it on that CPU's NUMA node
+    if (!cpus.empty()) {
+      pin_current_thread(HandlerCpu(i, 0));
+    }
     cqs.push_back(builder.AddCompletionQueue());
   }
+  if (!cpus.empty()) {
+    unpin_current_thread();
+  }
+  stats_cq = builder.AddCompletionQueue();
   server_ = builder.BuildAndStart();
   std::cout << "Server listening on " << server_address << std::endl;
   std::cout << "Server config " << config << std::endl;
@@ -136,30 +210,84 @@ void ServerImpl::Run(int nhandlers, bool debug) {
   std::cout << "Using " << local_address
             << " for local breadcrumb" << std::endl;
 
+  // Compile the routing table; this also creates the clients to child
+  // servers.  Sharded handlers compile their own.
+  if (!sharded) {
+    routes.Compile(config, this);
+  }
+
+  // Start the compute pool, if computation is offloaded
+  if (compute_threads > 0 && !nocompute_) {
+    std::cout << "Starting " << compute_threads << " compute threads" << std::endl;
+    compute_pool.reset(new ComputePool(compute_threads, config, priority_scheduling, gemm_batch));
+  }
+
+  // Batch matrix computation across requests, if enabled.  Shards batch
+  // only their own requests.
+  if (gemm_batch > 1 && !nocompute_) {
+    std::cout << "Batching up to " << gemm_batch << " matrix computations within "
+              << gemm_batch_delay_us << "us" << (sharded ? " per shard" : "") << std::endl;
+    if (!sharded) {
+      gemm_batcher.reset(new GemmBatcher(gemm_batch, gemm_batch_delay_us, compute_pool.get()));
+    }
+  }
+
+  work_threads = compute_pool != nullptr ? compute_threads : nhandlers * cq_threads;
+
   // Start the handler threads
-  std::cout << "Starting " << nhandlers << " handlers" << std::endl;
+  std::cout << "Starting " << nhandlers << " handlers with " << cq_threads
+            << " threads each" << std::endl;
   for (int i = 0; i < nhandlers; i++) {
     ServerHandler* handler =
       new ServerHandler(this, i, cqs[i].get(), local_address, config);
     handlers.push_back(handler);
-    threads.push_back(std::thread(&ServerHandler::Run, handler));
+    for (int j = 0; j < cq_threads; j++) {
+      threads.push_back(std::thread(&ServerHandler::Run, handler, j));
+    }
   }
 
+  threads.push_back(std::thread(&ServerImpl::StatsThread, this));
+
   if (debug) {
     threads.push_back(std::thread(&ServerImpl::PrintThread, this));
   }
 }
 
+// Handler threads are assigned CPUs from the list in order, wrapping around
+// if there are more threads than CPUs
+int ServerImpl::HandlerCpu(int handler, int thread) {
+  if (cpus.empty()) {
+    return -1;
+  }
+  return cpus[(handler * cq_threads + thread) % cpus.size()];
+}
+
 void ServerImpl::Shutdown() {
+  // Calls waiting in bulkheads would hold up their requests, and so the
+  // server's shutdown, for good
+  {
+    std::lock_guard<std::mutex> guard(clients_mutex);
+    for (auto &p : clients) {
+      p.second->Shutdown();
+    }
+  }
   server_->Shutdown();
+  stats_cq->Shutdown();
+  // Compute threads resume requests on the handlers' completion queues, so
+  // stop them before the queues are shut down
+  if (compute_pool != nullptr) {
+    compute_pool->Shutdown();
+  }
   alive = false;
   // Always shutdown the completion queue after the server.
   Join();
 }
 
 void ServerImpl::Join() {
-  for (int i = 0; i < threads.size(); i++) {
-    threads[i].join();
+  for (size_t i = 0; i < threads.size(); i++) {
+    if (threads[i].joinable()) {
+      threads[i].join();
+    }
   }
 }
 
@@ -168,6 +296,16 @@ uint64_t now() {
     std::chrono::high_resolution_clock::now().time_since_epoch()).count();
 }
 
+// Runs until Shutdown shuts the stats completion queue down and it drains
+void ServerImpl::StatsThread() {
+  new StatsCall(this, stats_cq.get());
+  void* tag;
+  bool ok;
+  while (stats_cq->Next(&tag, &ok)) {
+    static_cast<Callback*>(tag)->Proceed(ok);
+  }
+}
+
 void ServerImpl::PrintThread() {
   std::cout << "PrintThread running\n";
   // Ignore first second of requests
@@ -182,18 +320,42 @@ void ServerImpl::PrintThread() {
   uint64_t last_awaitingchildren;
   uint64_t last_finishing;
   uint64_t last_completed;
+  uint64_t last_rejected;
+  uint64_t last_queued;
+  uint64_t last_hedged;
+  uint64_t last_hedge_wins;
+  uint64_t last_tracing_ns;
 
   uint64_t cur_awaiting;
   uint64_t cur_processing;
   uint64_t cur_awaitingchildren;
   uint64_t cur_finishing;
   uint64_t cur_completed;
+  uint64_t cur_rejected;
+  uint64_t cur_queued;
+  uint64_t cur_hedged;
+  uint64_t cur_hedge_wins;
+  uint64_t cur_tracing_ns;
   
-  last_awaiting = awaiting;
-  last_processing = processing;
-  last_awaitingchildren = awaitingchildren;
-  last_finishing = finishing;
-  last_completed = completed;
+  last_awaiting = Total(&HandlerCounters::awaiting);
+  last_processing = Total(&HandlerCounters::processing);
+  last_awaitingchildren = Total(&HandlerCounters::awaitingchildren);
+  last_finishing = Total(&HandlerCounters::finishing);
+  last_completed = Total(&HandlerCounters::completed);
+  last_rejected = Total(&HandlerCounters::rejected);
+  last_queued = Total(&HandlerCounters::queued);
+  last_hedged = Total(&HandlerCounters::hedged);
+  last_hedge_wins = Total(&HandlerCounters::hedge_wins);
+  last_tracing_ns = Total(&HandlerCounters::tracing_ns);
+
+  // The stage latencies of each API, as of the last print
+  const std::map<std::string, API>& apis = config.get_apis();
+  std::map<std::string, std::vector<HistogramSnapshot>> last_latency;
+  for (auto &p : apis) {
+    for (int stage = 0; stage < REQUEST_STAGES; stage++) {
+      last_latency[p.first].push_back(Latency(p.second.id, stage));
+    }
+  }
 
   // print per second
   uint64_t last_print = now();
@@ -204,17 +366,86 @@ void ServerImpl::PrintThread() {
       usleep(10000);
     }
 
-    cur_awaiting = awaiting;
-    cur_processing = processing;
-    cur_awaitingchildren = awaitingchildren;
-    cur_finishing = finishing;
-    cur_completed = completed;
-
-    printf("-- Admitting  %lu (%lu)\n", cur_awaiting - cur_processing, cur_awaiting - last_awaiting);
+    cur_awaiting = Total(&HandlerCounters::awaiting);
+    cur_processing = Total(&HandlerCounters::processing);
+    cur_awaitingchildren = Total(&HandlerCounters::awaitingchildren);
+    cur_finishing = Total(&HandlerCounters::finishing);
+    cur_completed = Total(&HandlerCounters::completed);
+    cur_rejected = Total(&HandlerCounters::rejected);
+    cur_queued = Total(&HandlerCounters::queued);
+    cur_hedged = Total(&HandlerCounters::hedged);
+    cur_hedge_wins = Total(&HandlerCounters::hedge_wins);
+    cur_tracing_ns = Total(&HandlerCounters::tracing_ns);
+
+    printf("-- Admitting  %lu (%lu)\n", cur_awaiting - cur_processing - cur_rejected, cur_awaiting - last_awaiting);
     printf("   Processing %lu (%lu)\n", cur_processing - cur_awaitingchildren, cur_processing - last_processing);
     printf("   Children   %lu (%lu)\n", cur_awaitingchildren - cur_finishing, cur_awaitingchildren - last_awaitingchildren);
     printf("   Finishing  %lu (%lu)\n", cur_finishing - cur_completed, cur_finishing - last_finishing);
     printf("   Completed  %lu\n", cur_completed - last_completed);
+    printf("   Rejected   %lu\n", cur_rejected - last_rejected);
+    printf("   Queued     %lu\n", cur_queued - last_queued);
+    printf("   Hedged     %lu (%lu won)\n", cur_hedged - last_hedged, cur_hedge_wins - last_hedge_wins);
+    printf("   Tracing    %lu us\n", (cur_tracing_ns - last_tracing_ns) / 1000);
+
+    int limit = 0;
+    for (ServerHandler* handler : handlers) {
+      limit += handler->limiter.limit();
+    }
+    printf("   Limit      %d\n", limit);
+
+    // p50 and p99 of each stage in microseconds, over the requests
+    // completed since the last print
+    for (auto &p : apis) {
+      std::vector<HistogramSnapshot>& last = last_latency[p.first];
+      std::string line;
+      uint64_t count = 0;
+      for (int stage = 0; stage < REQUEST_STAGES; stage++) {
+        HistogramSnapshot cur = Latency(p.second.id, stage);
+        HistogramSnapshot interval = cur.Since(last[stage]);
+        last[stage] = cur;
+        count = interval.count();
+        line += std::string(" ") + request_stage_name(stage) + " " +
+          std::to_string(interval.Percentile(50) / 1000) + "/" +
+          std::to_string(interval.Percentile(99) / 1000);
+      }
+      if (count > 0) {
+        printf("   API %s: %lu requests, p50/p99 us:%s\n", p.first.c_str(), count, line.c_str());
+      }
+    }
+
+    // Cycles and CPU time per sampled request, by category, since startup
+    if (perf_sample > 0) {
+      for (auto &p : apis) {
+        PerfSample totals[PERF_CATEGORIES];
+        uint64_t requests = PerfTotal(p.second.id, totals);
+        if (requests == 0) continue;
+        std::string line;
+        for (int c = 0; c < PERF_CATEGORIES; c++) {
+          line += std::string(" ") + perf_category_name(c) + " " +
+            std::to_string(totals[c].values[PERF_CYCLES] / requests) + "/" +
+            std::to_string(totals[c].values[PERF_CPU_NS] / requests);
+        }
+        printf("   Perf %s: %lu sampled, cycles/cpu ns per request:%s\n", p.first.c_str(), requests, line.c_str());
+      }
+    }
+
+    if (child_limit > 0) {
+      std::lock_guard<std::mutex> guard(clients_mutex);
+      for (auto &p : clients) {
+        ChildClient* client = p.second;
+        int sending;
+        size_t waiting;
+        {
+          std::lock_guard<std::mutex> lock(client->bulkhead_mutex);
+          sending = client->sending;
+          waiting = client->waiting.size();
+        }
+        uint64_t queued = client->queued;
+        uint64_t wait_us = queued == 0 ? 0 : client->queued_ns / queued / 1000;
+        printf("   Child %s: %d sending, %zu waiting, %lu queued (avg %lu us), %lu rejected\n",
+               p.first.c_str(), sending, waiting, queued, wait_us, (uint64_t) client->rejected);
+      }
+    }
 
 
     last_awaiting = cur_awaiting;
@@ -222,36 +453,192 @@ void ServerImpl::PrintThread() {
     last_awaitingchildren = cur_awaitingchildren;
     last_finishing = cur_finishing;
     last_completed = cur_completed;
+    last_rejected = cur_rejected;
+    last_queued = cur_queued;
+    last_hedged = cur_hedged;
+    last_hedge_wins = cur_hedge_wins;
+    last_tracing_ns = cur_tracing_ns;
     
     next_print = next_print + print_every;
     last_print = t;
   }
 }
 
-ChildClient* ServerImpl::GetClient(std::string address) {
+uint64_t ServerImpl::Total(std::atomic_uint64_t HandlerCounters::* counter) {
+  uint64_t total = 0;
+  for (ServerHandler* handler : handlers) {
+    total += handler->counters.*counter;
+  }
+  return total;
+}
+
+HistogramSnapshot ServerImpl::Latency(int api_id, int stage) {
+  HistogramSnapshot snapshot;
+  for (ServerHandler* handler : handlers) {
+    snapshot.Merge(handler->latency[api_id]->stages[stage]);
+  }
+  return snapshot;
+}
+
+uint64_t ServerImpl::PerfTotal(int api_id, PerfSample* totals) {
+  uint64_t requests = 0;
+  for (ServerHandler* handler : handlers) {
+    PerfTotals& perf = *handler->perf[api_id];
+    requests += perf.requests;
+    for (int c = 0; c < PERF_CATEGORIES; c++) {
+      for (int v = 0; v < PERF_VALUES; v++) {
+        totals[c].values[v] += perf.values[c][v].load(std::memory_order_relaxed);
+      }
+    }
+  }
+  return requests;
+}
+
+// Like PrintThread, reads the handlers' counters and histograms without
+// locking them
+void ServerImpl::GetStats(StatsReply* reply) {
+  reply->set_service(config.Name());
+  reply->set_instance_id(instance_id);
+  reply->set_timestamp_ns(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count());
+
+  auto& counters = *reply->mutable_counters();
+  counters["awaiting"] = Total(&HandlerCounters::awaiting);
+  counters["processing"] = Total(&HandlerCounters::processing);
+  counters["awaitingchildren"] = Total(&HandlerCounters::awaitingchildren);
+  counters["finishing"] = Total(&HandlerCounters::finishing);
+  counters["completed"] = Total(&HandlerCounters::completed);
+  counters["rejected"] = Total(&HandlerCounters::rejected);
+  counters["queued"] = Total(&HandlerCounters::queued);
+  counters["hedged"] = Total(&HandlerCounters::hedged);
+  counters["hedge_wins"] = Total(&HandlerCounters::hedge_wins);
+
+  for (auto &p : config.get_apis()) {
+    ApiStats* api = reply->add_apis();
+    api->set_api(p.first);
+    for (int stage = 0; stage < REQUEST_STAGES; stage++) {
+      HistogramSnapshot snapshot = Latency(p.second.id, stage);
+      StageStats* stats = api->add_stages();
+      stats->set_stage(request_stage_name(stage));
+      LatencyBuckets* latency = stats->mutable_latency();
+      for (int i = 0; i < LatencyHistogram::buckets; i++) {
+        if (snapshot.count(i) > 0) {
+          latency->add_lower_bound_ns(LatencyHistogram::LowerBound(i));
+          latency->add_count(snapshot.count(i));
+        }
+      }
+      latency->set_total_count(snapshot.count());
+      latency->set_total_ns(snapshot.total());
+      latency->set_p50_ns(snapshot.Percentile(50));
+      latency->set_p99_ns(snapshot.Percentile(99));
+    }
+
+    if (perf_sample > 0) {
+      PerfSample totals[PERF_CATEGORIES];
+      api->set_perf_requests(PerfTotal(p.second.id, totals));
+      for (int c = 0; c < PERF_CATEGORIES; c++) {
+        PerfStats* perf = api->add_perf();
+        perf->set_category(perf_category_name(c));
+        perf->set_cycles(totals[c].values[PERF_CYCLES]);
+        perf->set_instructions(totals[c].values[PERF_INSTRUCTIONS]);
+        perf->set_llc_misses(totals[c].values[PERF_LLC_MISSES]);
+        perf->set_branch_misses(totals[c].values[PERF_BRANCH_MISSES]);
+        perf->set_cpu_ns(totals[c].values[PERF_CPU_NS]);
+      }
+    }
+  }
+  reply->set_perf_counters(perf_threads > 0);
+
+  for (ServerHandler* handler : handlers) {
+    for (clockid_t clock : handler->thread_clocks) {
+      struct timespec ts;
+      uint64_t cpu_ns = 0;
+      if (clock != CLOCK_THREAD_CPUTIME_ID && clock_gettime(clock, &ts) == 0) {
+        cpu_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+      }
+      reply->add_handler_thread_cpu_ns(cpu_ns);
+    }
+  }
+
+  TracerStats* tracer = reply->mutable_tracer();
+  tracer->set_hindsight(hindsight_enabled);
+  tracer->set_opentelemetry(opentelemetry_enabled);
+  tracer->set_tracing_ns(Total(&HandlerCounters::tracing_ns));
+
+  ProcessStats* process = reply->mutable_process();
+  long pages = 0;
+  std::ifstream statm("/proc/self/statm");
+  if (statm >> pages >> pages) {
+    process->set_rss_bytes((uint64_t) pages * sysconf(_SC_PAGESIZE));
+  }
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    process->set_user_cpu_ns(usage.ru_utime.tv_sec * 1000000000ULL + usage.ru_utime.tv_usec * 1000ULL);
+    process->set_system_cpu_ns(usage.ru_stime.tv_sec * 1000000000ULL + usage.ru_stime.tv_usec * 1000ULL);
+  }
+}
+
+ChildClient* ServerImpl::GetClient(std::string address, int shard) {
+  std::string key = shard < 0 ? address : address + "#" + std::to_string(shard);
   std::lock_guard<std::mutex> guard(clients_mutex);
-  auto it = clients.find(address);
+  auto it = clients.find(key);
   if (it != clients.end()) {
     return it->second;
   }
-  ChildClient* client = new ChildClient(address);
-  clients[address] = client;
+  ChildClient* client = new ChildClient(address, channels_per_client,
+    (ChildClient::ChannelSelection) channel_selection, child_limit, child_queue);
+  clients[key] = client;
   return client;
 }
 
-void ServerHandler::Run() {
-  // Spawn a new CallData instance to serve new clients.
-  PrepareNextRequest();
-  void* tag;  // uniquely identifies a request.
-  bool ok;
+void ServerHandler::Run(int thread) {
+  // Pin before creating the thread's state, so that its work engines and
+  // pooled requests are first touched on the thread's own NUMA node
+  int cpu = server_->HandlerCpu(handlerid_, thread);
+  if (cpu >= 0) {
+    if (pin_current_thread(cpu)) {
+      std::string msg = "Handler " + std::to_string(handlerid_) + " thread " + std::to_string(thread) +
+        " pinned to CPU " + std::to_string(cpu) + " (node " + std::to_string(cpu_numa_node(cpu)) + ")\n";
+      std::cout << msg;
+    } else {
+      std::cerr << "Unable to pin handler " << handlerid_ << " thread " << thread
+                << " to CPU " << cpu << std::endl;
+    }
+  }
+  uint64_t seed = mix64(server_->seed + handlerid_ * server_->cq_threads + thread);
+  // GEMM batches run on the compute pool if there is one, and otherwise on
+  // the handler threads
+  int max_batch = server_->compute_pool != nullptr ? 1 : server_->gemm_batch;
+  threads_[thread].reset(new HandlerThread(config, seed, server_->work_threads, max_batch));
+  threads_[thread]->MakeCurrent();
+  thread_counters = &counters;
+  pthread_getcpuclockid(pthread_self(), &thread_clocks[thread]);
+  if (server_->perf_sample > 0) {
+    if (threads_[thread]->perf.Open()) {
+      server_->perf_threads++;
+    } else if (handlerid_ == 0 && thread == 0) {
+      std::cerr << "Unable to open hardware counters; measuring CPU time only.  "
+                << "Check kernel.perf_event_paranoid, which must be 1 or less" << std::endl;
+    }
+  }
 
-  gpr_timespec deadline;
-  deadline.clock_type = GPR_TIMESPAN;
-  deadline.tv_sec = 0;
-  deadline.tv_nsec = 0;
-  grpc::CompletionQueue::NextStatus status;
+  // A shard's clients are created, like the rest of its state, on its own
+  // thread
+  if (server_->sharded && thread == 0) {
+    shard_routes.Compile(config, server_, handlerid_);
+    routes = &shard_routes;
+    if (server_->gemm_batch > 1 && !server_->nocompute_) {
+      gemm_batcher = new GemmBatcher(server_->gemm_batch, server_->gemm_batch_delay_us, nullptr);
+    }
+  }
 
-  int drain_threshold = server_->max_outstanding_requests / 2;
+  // Spawn new CallData instances to serve new clients.
+  if (thread == 0) {
+    PrepareNextRequest();
+    HandlerThread::current().batch_pool.Acquire(this)->Start();
+  }
+  void* tag;  // uniquely identifies a request.
+  bool ok;
 
   while (server_->alive) {
     // Block waiting to read the next event from the completion queue. The
@@ -259,37 +646,20 @@ void ServerHandler::Run() {
     // memory address of a CallData instance.
     // The return value of Next should always be checked. This return value
     // tells us whether there is any kind of event or cq_ is shutting down.
-    // GPR_ASSERT(cq_->Next(&tag, &ok));
-    // // reinterpret_cast<Callback*>(tag)->Proceed(ok);
-    // static_cast<Callback*>(tag)->Proceed(ok);
-
-    if (draining) {
-      if (admitting_requests == 0) {
-        status = cq_->AsyncNext(&tag, &ok, deadline);
-        if (status == grpc::CompletionQueue::NextStatus::GOT_EVENT) {
-          static_cast<Callback*>(tag)->Proceed(ok);
-
-        } else if (status == grpc::CompletionQueue::NextStatus::TIMEOUT) {
-          draining = false;
-          PrepareNextRequest();
-
-        } else {
-          break;
-        }
-      } else {
-        GPR_ASSERT(cq_->Next(&tag, &ok));
-        static_cast<Callback*>(tag)->Proceed(ok);
-      }
-    } else {
-      GPR_ASSERT(cq_->Next(&tag, &ok));
-      static_cast<Callback*>(tag)->Proceed(ok);
-
-      if (outstanding_requests >= drain_threshold) {
-        draining = true;
+    if (server_->busy_poll_us != 0) {
+      if (!BusyPoll(&tag, &ok)) {
+        break;
       }
+    } else if (!cq_->Next(&tag, &ok)) {
+      break;
     }
+    static_cast<Callback*>(tag)->Proceed(ok);
+  }
+
+  // The other threads see the shutdown once the queue is drained
+  if (thread == 0) {
+    cq_->Shutdown();
   }
-  cq_->Shutdown();
 }
 
 /*
@@ -301,65 +671,330 @@ parent_span_id + 3 : "HindsightGRPC/Exec/Finish"
 parent_span_id + 4 : "HindsightGRPC/Exec/Complete"
 */
 
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Polls the completion queue without blocking until there is an event.  If
+// there is none for busy_poll_us microseconds, blocks for the next one instead.
+// Returns false if the queue is shutting down.
+bool ServerHandler::BusyPoll(void** tag, bool* ok) {
+  gpr_timespec deadline = gpr_time_0(GPR_CLOCK_MONOTONIC);
+  uint64_t spin_until = 0;
+  for (uint64_t polls = 0; ; polls++) {
+    grpc::CompletionQueue::NextStatus status = cq_->AsyncNext(tag, ok, deadline);
+    if (status == grpc::CompletionQueue::NextStatus::GOT_EVENT) {
+      return true;
+    } else if (status == grpc::CompletionQueue::NextStatus::SHUTDOWN) {
+      return false;
+    }
+
+    // Check the clock, and for shutdown, only every so often
+    if (polls % 64 == 0) {
+      if (!server_->alive) {
+        return false;
+      }
+      if (server_->busy_poll_us > 0) {
+        uint64_t t = nanos();
+        if (polls == 0) {
+          spin_until = t + server_->busy_poll_us * 1000UL;
+        } else if (t >= spin_until) {
+          return cq_->Next(tag, ok);
+        }
+      }
+    }
+    cpu_relax();
+  }
+}
+
 void ServerHandler::PrepareNextRequest() {
-  // The completion queue stuff happens within the request class
-  if (!draining && admitting_requests == 0 && outstanding_requests < server_->max_outstanding_requests) {
-    new Request(this, request_id_seed++);
-    outstanding_requests++;
-    admitting_requests++;
+  // The completion queue stuff happens within the request class.  There are
+  // always accept_depth requests waiting for RPCs, so that a burst of RPCs
+  // can be accepted at once; admission is decided once each arrives, so that
+  // excess RPCs are rejected rather than left queued.  Several threads may
+  // top up at once, so each claims a slot before posting a request for it.
+  int admitting = admitting_requests.load();
+  while (admitting < server_->accept_depth) {
+    if (admitting_requests.compare_exchange_weak(admitting, admitting + 1)) {
+      HandlerThread::current().request_pool.Acquire(this)->Start(request_id_seed++);
+      admitting++;
+    }
   }
 }
 
-// Assumed not to be thread safe
-ChildClient* ServerHandler::GetClient(std::string address) {
-  auto it = clients.find(address);
-  if (it != clients.end()) {
-    return it->second;
+bool ServerHandler::Admit(Request* request) {
+  // Without a queue, admission is lock-free
+  if (server_->admission_queue <= 0) {
+    if (limiter.Admit(outstanding_requests++)) {
+      return true;
+    }
+    outstanding_requests--;
+    request->Reject();
+    return false;
   }
-  ChildClient* client = server_->GetClient(address);
-  clients[address] = client;
-  return client;
+
+  // With one, admission is decided under waiting_mutex, so that a new request
+  // can't take a free slot ahead of queued ones, and AdmitWaiting can't
+  // admit over the limit
+  Request* shed = request;
+  int priority = request->request_->priority();
+  {
+    std::lock_guard<std::mutex> lock(waiting_mutex);
+    if (waiting.empty() && limiter.Admit(outstanding_requests)) {
+      outstanding_requests++;
+      return true;
+    }
+
+    // Under overload, less important requests make way for more important
+    // ones
+    if (waiting.size() < (size_t) server_->admission_queue) {
+      shed = nullptr;
+    } else {
+      waiting.PopLeastImportant(shed, priority);
+    }
+    if (shed != request) {
+      request->status_ = Request::QUEUED;
+      request->queued_at_ = nanos();
+      waiting.Push(request, priority);
+      counters.queued++;
+    }
+  }
+  if (shed != nullptr) {
+    shed->Reject();
+  }
+
+  // A request may have finished since we checked the limit
+  if (shed != request) {
+    AdmitWaiting();
+  }
+  return false;
+}
+
+void ServerHandler::RequestFinished(uint64_t latency_ns) {
+  {
+    std::lock_guard<std::mutex> lock(limiter_mutex);
+    limiter.OnComplete(latency_ns, outstanding_requests);
+  }
+  outstanding_requests--;
+  // The freed slot, and any room the limit has grown by, go to queued
+  // requests first
+  if (server_->admission_queue > 0) {
+    AdmitWaiting();
+  }
+}
+
+void ServerHandler::AdmitWaiting() {
+  while (true) {
+    Request* request;
+    {
+      std::lock_guard<std::mutex> lock(waiting_mutex);
+      if (waiting.empty() || !limiter.Admit(outstanding_requests)) {
+        return;
+      }
+      waiting.Pop(request);
+      outstanding_requests++;
+    }
+    // Resume the request on the CQ, in the QUEUED state
+    request->alarm_.Set(cq_, gpr_time_0(GPR_CLOCK_MONOTONIC), request);
+  }
+}
+
+ServerHandler::~ServerHandler() {
+  if (server_->sharded) {
+    delete gemm_batcher;
+  }
+}
+
+thread_local HandlerThread* HandlerThread::current_ = nullptr;
+
+HandlerThread::HandlerThread(ServiceConfig config, uint64_t seed, int work_threads, int max_batch) :
+    rng(seed), perf_rng(~seed) {
+  create_work_engines(config, engines, work_threads, max_batch);
+}
+
+HandlerThread::~HandlerThread() {}
+
+
+static google::protobuf::ArenaOptions arena_options(char* initial_block, size_t size) {
+  google::protobuf::ArenaOptions options;
+  options.initial_block = initial_block;
+  options.initial_block_size = size;
+  return options;
+}
+
+Request::Request(ServerHandler* handler) : handler_(handler),
+    id(0), service_(&handler->server_->service_),
+    arena_(arena_options(arena_block_, sizeof(arena_block_))),
+    status_(CREATE), route_(nullptr), exec_duration(0), batch_(nullptr), batch_index_(0),
+    outstanding_children(0), deadline_(std::chrono::system_clock::time_point::max()),
+    cancelled_(false), queued_at_(0), arrived_at_(0), computed_at_(0), completed_at_(0),
+    gemm_batch_size_(0), gemm_batch_wait_(0), perf_sampled_(false),
+    done_callback_(this), refs_(0) {
+  request_ = google::protobuf::Arena::CreateMessage<ExecRequest>(&arena_);
+  reply_ = google::protobuf::Arena::CreateMessage<ExecReply>(&arena_);
+  ctx_ = new (&ctx_storage_) ServerContext();
+  responder_ = new (&responder_storage_) Responder(ctx_);
 }
 
+Request::~Request() {
+  responder_->~Responder();
+  ctx_->~ServerContext();
+}
 
-Request::Request(ServerHandler* handler, int requestid) : handler_(handler),
-    id(requestid), service_(&handler->server_->service_), responder_(&ctx_),
-    status_(CREATE), outstanding_children(0) {
+void Request::Start(int requestid) {
+  id = requestid;
+  status_ = CREATE;
   // Invoke the serving logic right away.
   Proceed(true);
 }
 
-Request::~Request() {}
+// Serves one of the calls of an ExecBatch RPC.  There is no RPC of our own
+// to wait for, so go straight to PROCESS.
+void Request::StartBatched(BatchRequest* batch, int index) {
+  id = index;
+  batch_ = batch;
+  batch_index_ = index;
+  request_->CopyFrom(batch->request_.calls(index));
+  handler_->counters.awaiting++;
+  refs_ = 1;
+  status_ = PROCESS;
+  Proceed(true);
+}
+
+// Resets the request for the next RPC and returns it to the handler's pool.
+// The protobuf messages are cleared in place, keeping their allocations.
+void Request::Recycle() {
+  // Release the request's messages, and its child calls' messages, in one
+  // shot; the arena keeps its initial block for the next RPC
+  arena_.Reset();
+  request_ = google::protobuf::Arena::CreateMessage<ExecRequest>(&arena_);
+  reply_ = google::protobuf::Arena::CreateMessage<ExecReply>(&arena_);
+
+  responder_->~Responder();
+  ctx_->~ServerContext();
+  ctx_ = new (&ctx_storage_) ServerContext();
+  responder_ = new (&responder_storage_) Responder(ctx_);
+
+  request_span = nostd::shared_ptr<Span>();
+  process_span = nostd::shared_ptr<Span>();
+  hs_.reset();
+  route_ = nullptr;
+  targets_.clear();
+  target_calls_.clear();
+  exec_duration = 0;
+  batch_ = nullptr;
+  batch_index_ = 0;
+  outstanding_children = 0;
+  children_.clear();
+  deadline_ = std::chrono::system_clock::time_point::max();
+  cancelled_ = false;
+  queued_at_ = 0;
+  arrived_at_ = 0;
+  computed_at_ = 0;
+  completed_at_ = 0;
+  gemm_batch_size_ = 0;
+  gemm_batch_wait_ = 0;
+  perf_sampled_ = false;
+
+  HandlerThread::current().request_pool.Release(this);
+}
+
+void Request::Release() {
+  if (--refs_ == 0) {
+    Recycle();
+  }
+}
+
+// If the caller cancelled the RPC, or its deadline passed, stop waiting for
+// our children; their responses will complete the request
+void Request::Done() {
+  if (ctx_->IsCancelled()) {
+    Cancel();
+  }
+  Release();
+}
+
+void Request::Cancel() {
+  cancelled_ = true;
+  std::lock_guard<std::mutex> lock(children_mutex_);
+  for (ChildCall* call : children_) {
+    if (call != nullptr) {
+      call->Cancel();
+    }
+  }
+}
+
+bool Request::Abandoned() {
+  if (!cancelled_ && deadline_ != std::chrono::system_clock::time_point::max() &&
+      std::chrono::system_clock::now() > deadline_) {
+    cancelled_ = true;
+  }
+  return cancelled_;
+}
 
 void Request::Proceed(bool ok) {
+  // Sampled requests measure each of their stages with hardware counters
+  int perf_sample = handler_->server_->perf_sample;
+  if (status_ == PROCESS && perf_sample > 0) {
+    perf_sampled_ = HandlerThread::current().perf_rng.Below(perf_sample) == 0;
+  }
+  PerfStage perf_stage(perf_sampled_, PerfTotalsFor());
+
   if (status_ == CREATE) {
     status_ = PROCESS;
-    service_->RequestExec(&ctx_, &request_, &responder_, handler_->cq_,
+    // FINISH, and gRPC's notification that it is done with the RPC
+    refs_ = 2;
+    ctx_->AsyncNotifyWhenDone(&done_callback_);
+    service_->RequestExec(ctx_, request_, responder_, handler_->cq_,
       handler_->cq_, this);
-    handler_->server_->awaiting++;
+    handler_->counters.awaiting++;
 
-  } else if (status_ == PROCESS) {
+  } else if (status_ == PROCESS || status_ == QUEUED) {
     if (!ok) {
       // The completion queue is shutting down
       // and we don't actually have a request
-      delete this;
+      Release();
       return;
     }
-    handler_->server_->processing++;
+
+    // Batched calls weren't accepted by the handler, but are admitted like
+    // any other request.  Queued requests were admitted when they were taken
+    // off the queue.
+    if (status_ == PROCESS) {
+      arrived_at_ = nanos();
+      if (batch_ == nullptr) {
+        handler_->admitting_requests--;
+        handler_->PrepareNextRequest();
+      }
+
+      if (!handler_->Admit(this)) {
+        return;
+      }
+    }
+    status_ = PROCESS;
+    handler_->counters.processing++;
 
     start_time = nanos();
 
-    std::string api = request_.api();
+    const std::string &api = request_->api();
 
     // Debug logging is orthogonal to tracing
     REQUESTDEBUG(
-      if (request_.debug()) {
-        std::cout << "[DEBUG] Received:\n" << request_.DebugString()
+      if (request_->debug()) {
+        std::cout << "[DEBUG] Received:\n" << request_->DebugString()
                   << "===" << std::endl;
         std::cout << "[DEBUG] Received context:\n";
-        auto &metadata = ctx_.client_metadata();
-        for (auto it = metadata.begin(); it != metadata.end(); ++it) {
-          std::cout << "  " << (*it).first << ": " << (*it).second << std::endl;
+        if (batch_ != nullptr) {
+          for (auto &p : request_->metadata()) {
+            std::cout << "  " << p.first << ": " << p.second << std::endl;
+          }
+        } else {
+          auto &metadata = ctx_->client_metadata();
+          for (auto it = metadata.begin(); it != metadata.end(); ++it) {
+            std::cout << "  " << (*it).first << ": " << (*it).second << std::endl;
+          }
         }
         std::cout << "===" << std::endl;
       }
@@ -372,25 +1007,33 @@ void Request::Proceed(bool ok) {
       options.parent = extractContextFromRPC();
       request_span = handler_->tracer_->StartSpan("HindsightGRPC/Exec", options);
       request_span->SetAttribute("API", api);
-      request_span->SetAttribute("Interval", request_.interval());
+      request_span->SetAttribute("Interval", request_->interval());
+      request_span->SetAttribute("Priority", request_->priority());
+      if (queued_at_ != 0) {
+        request_span->SetAttribute("AdmissionWait", (int64_t) (start_time - queued_at_));
+      }
 
       // Extract breadcrumb
-      auto it = ctx_.client_metadata().find("breadcrumb");
-      if (it != ctx_.client_metadata().end()) {
-        request_span->SetAttribute("Breadcrumb", std::string(it->second.data()));
+      if (batch_ != nullptr) {
+        auto it = request_->metadata().find("breadcrumb");
+        if (it != request_->metadata().end()) {
+          request_span->SetAttribute("Breadcrumb", it->second);
+        }
+      } else {
+        auto it = ctx_->client_metadata().find("breadcrumb");
+        if (it != ctx_->client_metadata().end()) {
+          request_span->SetAttribute("Breadcrumb", std::string(it->second.data()));
+        }
       }
 
       // span_ will be the active span until exec_scope is destroyed
       exec_scope = std::make_shared<Scope>(request_span);
     )
 
-    handler_->admitting_requests--;
-    handler_->PrepareNextRequest();
-
     uint64_t span_id;
     HINDSIGHT(
-      if (request_.has_hindsight()) {
-        auto &hindsight_context = request_.hindsight();
+      if (request_->has_hindsight()) {
+        auto &hindsight_context = request_->hindsight();
 
         hs_ = std::make_shared<HindsightTraceState>(
             hindsight_context.trace_id(), hindsight_context.span_id());
@@ -414,15 +1057,18 @@ void Request::Proceed(bool ok) {
       hs_->LogSpanParent(span_id, hs_->parent_span_id);
       hs_->LogSpanKind(span_id, 0);
       hs_->LogSpanAttributeStr(span_id, "API", api);
-      hs_->LogSpanAttribute(span_id, "Interval", request_.interval());
+      hs_->LogSpanAttribute(span_id, "Interval", request_->interval());
+      hs_->LogSpanAttribute(span_id, "Priority", request_->priority());
+      if (queued_at_ != 0) {
+        hs_->LogSpanAttribute(span_id, "AdmissionWait", start_time - queued_at_);
+      }
     )
 
     std::shared_ptr<Scope> process_scope;
-    nostd::shared_ptr<Span> span;
     OPENTELEMETRY(
       // Create a nested span for PROCESS specifically
-      span = handler_->tracer_->StartSpan("HindsightGRPC/Exec/Process");
-      process_scope = std::make_shared<Scope>(span);
+      process_span = handler_->tracer_->StartSpan("HindsightGRPC/Exec/Process");
+      process_scope = std::make_shared<Scope>(process_span);
     )
     HINDSIGHT(
       span_id = hs_->parent_span_id + 2;
@@ -433,110 +1079,92 @@ void Request::Proceed(bool ok) {
       hs_->LogSpanKind(span_id, 0);
     )
 
-    API& api_info = handler_->server_->config.get_api(api);
+    route_ = handler_->routes->Lookup(request_->api_id(), api);
+    if (route_ == nullptr) {
+      REQUESTDEBUG(
+        if (request_->debug()) {
+          std::cout << "[DEBUG] Unknown API " << api << std::endl;
+        }
+      )
+      OPENTELEMETRY(
+        process_span->AddEvent("Unknown API");
+        process_span->End();
+      )
+      HINDSIGHT(
+        hs_->LogSpanEvent(span_id, "Unknown API");
+        hs_->LogSpanEnd(span_id);
+      )
+      handler_->counters.awaitingchildren++;
+      Complete(Status(grpc::StatusCode::NOT_FOUND, "Unknown API " + api));
+      return;
+    }
+    if (perf_sampled_) {
+      perf_stage.SetTotals(PerfTotalsFor());
+      PerfTotalsFor()->requests++;
+    }
+
+    // Child calls inherit the caller's deadline, or the API's timeout if
+    // that is sooner
+    deadline_ = batch_ != nullptr ? batch_->ctx_->deadline() : ctx_->deadline();
+    if (route_->api->timeout > 0) {
+      deadline_ = std::min(deadline_, std::chrono::system_clock::now() +
+        std::chrono::microseconds((int64_t) (route_->api->timeout * 1000)));
+    }
 
     REQUESTDEBUG(
-      if (request_.debug()) {
-        std::cout << "[DEBUG] Executing API\n" << api_info << "===" << std::endl;
+      if (request_->debug()) {
+        std::cout << "[DEBUG] Executing API\n" << *route_->api << "===" << std::endl;
       }
     )
     OPENTELEMETRY(
-      span->AddEvent("Executing API");
-      span->SetAttribute("Exec", api_info.exec);
+      process_span->AddEvent("Executing API");
+      process_span->SetAttribute("Exec", route_->api->exec);
     )
     HINDSIGHT(
       hs_->LogSpanEvent(span_id, "Executing API");
-      hs_->LogSpanAttribute(span_id, "Exec", api_info.exec);
+      hs_->LogSpanAttribute(span_id, "Exec", route_->api->exec);
     )
 
     // Computation can be disabled via the nocompute command line argument
-    int64_t exec_duration = 0;
+    exec_duration = 0;
     if (!handler_->server_->nocompute_) {
-      MatrixConfig config = handler_->server_->config.get_matrix_config(api);
-
-      REQUESTDEBUG(
-        if (request_.debug()) {
-          std::cout << "[DEBUG] Executing MatrixConfig " << config << std::endl;
-        }
-      )
-
-      uint64_t begin = nanos();
-      double result = hindsightgrpc::matrix_multiply(config);
-      exec_duration = nanos() - begin;
-
-      REQUESTDEBUG(
-        if (request_.debug()) {
-          std::cout << "[DEBUG] Took " << exec_duration
-                    << " nanos to calculate " << result << std::endl;
-        }
-      )
-    }
-
-    OPENTELEMETRY(
-      span->SetAttribute("MatrixExec", exec_duration);
-    )
-    HINDSIGHT(
-      hs_->LogSpanAttribute(span_id, "MatrixExec", exec_duration);
-    )
-
+      // The batcher resumes us in the COMPUTE state once our batch has run
+      GemmBatcher* batcher = handler_->gemm_batcher;
+      if (batcher != nullptr && GemmBatcher::Batches(route_->engine)) {
+        status_ = COMPUTE;
+        batcher->Add(this);
+        return;
+      }
 
-    OPENTELEMETRY(
-      span->AddEvent("Calling Children");
-    )
-    HINDSIGHT(
-      hs_->LogSpanEvent(span_id, "Calling Children");
-    )
-
-    // Use the child-call services based on the API info in the ServiceConfig
-    std::vector<Outcall*> child_calls;
-    for (auto& child : api_info.children) {
-      if (rand() % 100 < child.probability) {
-        if (child.subcalls.size() > 0) {
-          // randomly choosing an instance of the target services
-          assert(child.subcalls.size() != 1);
-          child_calls.push_back(
-              &child.subcalls[rand() % child.subcalls.size()]);
-        } else {
-          child_calls.push_back(&child);
-        }
+      ComputePool* pool = handler_->server_->compute_pool.get();
+      if (pool != nullptr) {
+        // The pool resumes us in the COMPUTE state
+        status_ = COMPUTE;
+        pool->Submit(this, request_->priority());
+        return;
       }
+      Compute(HandlerThread::current().engines);
     }
+    EndProcess();
 
-    handler_->server_->awaitingchildren++;
-    if (child_calls.size() > 0) {
-      InvokeChildren(child_calls, span_id);
-
-      OPENTELEMETRY(
-        span->AddEvent("Awaiting Child Responses");
-      )
-      HINDSIGHT(
-        hs_->LogSpanEvent(span_id, "Awaiting Child Responses");
-      )
-    } else {
-      OPENTELEMETRY(
-        span->AddEvent("Not making child calls");
-      )
-      HINDSIGHT(
-        hs_->LogSpanEvent(span_id, "Not making child calls");
-      )
-
-      Complete();
+  } else if (status_ == COMPUTE) {
+    if (!ok) {
+      // The completion queue is shutting down
+      Release();
+      return;
     }
 
-    REQUESTDEBUG(
-      if (request_.debug()) {
-        std::cout << "[DEBUG] Finished Handling Request" << std::endl;
-      }
-    )
-
+    // Restore the spans that were active before handing off to the pool
+    std::shared_ptr<Scope> exec_scope;
+    std::shared_ptr<Scope> process_scope;
     OPENTELEMETRY(
-      // End the inner span but leave the outer span
-      span->End();
-    )
-    HINDSIGHT(
-      hs_->LogSpanEnd(span_id);
+      exec_scope = std::make_shared<Scope>(request_span);
+      process_scope = std::make_shared<Scope>(process_span);
     )
+    EndProcess();
+
   } else if (status_ == FINISH) {
+    std::unique_lock<std::mutex> lock(children_mutex_);
     std::shared_ptr<Scope> parentscope;
     std::shared_ptr<Scope> scope;
     nostd::shared_ptr<Span> span;
@@ -564,7 +1192,7 @@ void Request::Proceed(bool ok) {
     )
 
     if (!ok) {
-    // if (request_.mutable_hindsight()->triggerflag() && (rand() % 100 < 10)) {
+    // if (request_->mutable_hindsight()->triggerflag() && (rand() % 100 < 10)) {
       OPENTELEMETRY(
         span->SetStatus(opentelemetry::trace::StatusCode::kError, "RPC response was not OK");
       )
@@ -573,7 +1201,7 @@ void Request::Proceed(bool ok) {
       )
     // }
       REQUESTDEBUG(
-        if (request_.debug()) {
+        if (request_->debug()) {
           std::cout << "[DEBUG] RPC Response NOT ok\n";
         }
       )
@@ -585,18 +1213,18 @@ void Request::Proceed(bool ok) {
         hs_->LogSpanStatus(span_id, (int) opentelemetry::trace::StatusCode::kOk, "RPC response was OK");
       )
       REQUESTDEBUG(
-        if (request_.debug()) {
+        if (request_->debug()) {
           std::cout << "[DEBUG] Request complete\n";
         }
       )
     }
 
-    if (request_.mutable_hindsight()->triggerflag()) {
+    if (request_->mutable_hindsight()->triggerflag()) {
       // fire the trigger only when 
       for (auto &p : handler_->server_->triggers) {
         int queue_id = p.first;
         uint64_t trigger_threshold = p.second;
-        if (rand() >= trigger_threshold) continue;
+        if (HandlerThread::current().rng.Next32() >= trigger_threshold) continue;
 
         auto trigger_count = TRIGGER++;
 
@@ -615,7 +1243,7 @@ void Request::Proceed(bool ok) {
         )
 
         REQUESTDEBUG(
-          if (request_.debug()) {
+          if (request_->debug()) {
             std::cout << "[DEBUG] Triggering for queue " << queue_id << std::endl;
           }
         )
@@ -655,37 +1283,313 @@ void Request::Proceed(bool ok) {
     HINDSIGHT(
       hs_->LogSpanEnd(span_id);
     )
+    lock.unlock();
+
+    handler_->counters.completed++;
+    RecordStages();
+    // The limiter sees the time spent on this server; time waiting for
+    // children is up to the children's servers
+    uint64_t local_ns = nanos() - start_time;
+    if (computed_at_ != 0 && completed_at_ > computed_at_) {
+      local_ns -= completed_at_ - computed_at_;
+    }
+    handler_->RequestFinished(local_ns);
+    if (batch_ != nullptr) {
+      batch_->CallFinished(this, ok);
+    }
 
-    handler_->outstanding_requests--;
-    handler_->server_->completed++;
+    // Once in the FINISH state, return ourselves to the pool (CallData).
+    Release();
 
-    // Once in the FINISH state, deallocate ourselves (CallData).
-    delete this;
+  } else if (status_ == REJECTED) {
+    if (batch_ != nullptr) {
+      batch_->CallFinished(this, false);
+    }
+    Release();
 
   } else {
     std::cout << "Unexpected transition" << std::endl;
   }
 }
 
-void Request::InvokeChildren(std::vector<Outcall*> outcalls, uint64_t span_id) {
-  status_ = AWAITCHILDREN;
-
-  for (auto& outcall : outcalls) {
-    std::string address = outcall->server_addr;
-    ChildClient* client = handler_->GetClient(address);
-    outstanding_children++;
-    // 10000 as a hard code interval between parent and child spans
-    client->Call(this, outcall, 10000 + span_id);
-    span_id += 2;
+PerfTotals* Request::PerfTotalsFor() {
+  if (route_ == nullptr || route_->api->id >= (int) handler_->perf.size()) {
+    return nullptr;
   }
+  return handler_->perf[route_->api->id].get();
+}
+
+// Requests for unknown APIs, and rejected requests, aren't recorded
+void Request::RecordStages() {
+  if (route_ == nullptr || computed_at_ == 0 || route_->api->id >= (int) handler_->latency.size()) {
+    return;
+  }
+  uint64_t finished_at = nanos();
+  LatencyHistogram* stages = handler_->latency[route_->api->id]->stages;
+  stages[ADMISSION_STAGE].Record(start_time - arrived_at_);
+  stages[COMPUTE_STAGE].Record(computed_at_ - start_time);
+  stages[CHILDREN_STAGE].Record(completed_at_ - computed_at_);
+  stages[FINISH_STAGE].Record(finished_at - completed_at_);
+  stages[END_TO_END].Record(finished_at - arrived_at_);
+}
+
+// Runs the API's work engine; called inline or on a compute pool thread
+void Request::Compute(WorkEngines& engines) {
+  const MatrixConfig &config = route_->matrix;
+  WorkEngine* engine = engines[route_->engine].get();
+
+  REQUESTDEBUG(
+    if (request_->debug()) {
+      std::cout << "[DEBUG] Executing " << route_->api->engine
+                << " engine with MatrixConfig " << config << std::endl;
+    }
+  )
+
+  // Nobody is waiting for the result of an abandoned request, eg one that
+  // was cancelled while queued for the compute pool
+  if (!Abandoned()) {
+    uint64_t begin = nanos();
+    double result;
+    {
+      PerfRegion region(PERF_WORK);
+      result = engine->Run(route_->api->exec, config);
+    }
+    exec_duration = nanos() - begin;
+
+    REQUESTDEBUG(
+      if (request_->debug()) {
+        std::cout << "[DEBUG] Took " << exec_duration
+                  << " nanos to calculate " << result << std::endl;
+      }
+    )
+  }
+
+  if (status_ == COMPUTE) {
+    // Hand the request back to its handler's completion queue
+    alarm_.Set(handler_->cq_, gpr_time_0(GPR_CLOCK_MONOTONIC), this);
+  }
+}
+
+// The remainder of PROCESS once computation is done: fan out to children
+void Request::EndProcess() {
+  computed_at_ = nanos();
+
+  uint64_t span_id;
+  HINDSIGHT(
+    span_id = hs_->parent_span_id + 2;
+  )
+
+  OPENTELEMETRY(
+    process_span->SetAttribute("MatrixExec", exec_duration);
+    if (gemm_batch_size_ > 0) {
+      process_span->SetAttribute("GemmBatchSize", gemm_batch_size_);
+      process_span->SetAttribute("GemmBatchWait", (int64_t) gemm_batch_wait_);
+    }
+  )
+  HINDSIGHT(
+    hs_->LogSpanAttribute(span_id, "MatrixExec", exec_duration);
+    if (gemm_batch_size_ > 0) {
+      hs_->LogSpanAttribute(span_id, "GemmBatchSize", gemm_batch_size_);
+      hs_->LogSpanAttribute(span_id, "GemmBatchWait", gemm_batch_wait_);
+    }
+  )
+
+
+  OPENTELEMETRY(
+    process_span->AddEvent("Calling Children");
+  )
+  HINDSIGHT(
+    hs_->LogSpanEvent(span_id, "Calling Children");
+  )
+
+  // Fan-out decisions normally use the handler thread's generator.  In deterministic
+  // mode they use one seeded by the request's fanout_key, which the client
+  // picks per trace and which is passed on to each child, so that a trace
+  // makes the same decisions on every run regardless of tracer.
+  Xoshiro256 trace_rng;
+  Xoshiro256* rng = &HandlerThread::current().rng;
+  if (handler_->server_->deterministic_fanout) {
+    trace_rng.Seed(request_->fanout_key());
+    rng = &trace_rng;
+  }
+
+  // Use the child-call services based on the API's route.  targets_ keeps
+  // its capacity across recycling, so this doesn't allocate.  Abandoned
+  // requests make no child calls.
+  bool abandoned = Abandoned();
+  for (auto& call : route_->calls) {
+    if (abandoned) break;
+    if (rng->Next32() < call.threshold) {
+      // choosing an instance of the target service
+      targets_.push_back(call.Pick(*rng, handler_->server_->replica_selection));
+      target_calls_.push_back(&call);
+    }
+  }
+
+  handler_->counters.awaitingchildren++;
+
+  // Children may complete on other handler threads while we're still here,
+  // so hold off their logging, and hold an extra count so that the last of
+  // them doesn't complete the request until we're done with it
+  outstanding_children = 1;
+  {
+    std::lock_guard<std::mutex> lock(children_mutex_);
+    // Done may have cancelled the request since we checked, before there
+    // were any children for it to cancel
+    if (!abandoned && cancelled_) {
+      abandoned = true;
+      targets_.clear();
+      target_calls_.clear();
+    }
+    if (abandoned) {
+      OPENTELEMETRY(
+        process_span->AddEvent("Request abandoned");
+      )
+      HINDSIGHT(
+        hs_->LogSpanEvent(span_id, "Request abandoned");
+      )
+    } else if (targets_.size() > 0) {
+      InvokeChildren(span_id);
+
+      OPENTELEMETRY(
+        process_span->AddEvent("Awaiting Child Responses");
+      )
+      HINDSIGHT(
+        hs_->LogSpanEvent(span_id, "Awaiting Child Responses");
+      )
+    } else {
+      OPENTELEMETRY(
+        process_span->AddEvent("Not making child calls");
+      )
+      HINDSIGHT(
+        hs_->LogSpanEvent(span_id, "Not making child calls");
+      )
+    }
+
+    REQUESTDEBUG(
+      if (request_->debug()) {
+        std::cout << "[DEBUG] Finished Handling Request" << std::endl;
+      }
+    )
+
+    OPENTELEMETRY(
+      // End the inner span but leave the outer span
+      process_span->End();
+    )
+    HINDSIGHT(
+      hs_->LogSpanEnd(span_id);
+    )
+  }
+  ChildDone();
+}
+
+void Request::InvokeChildren(uint64_t span_id) {
+  status_ = AWAITCHILDREN;
+
+  if (handler_->server_->batch_children) {
+    InvokeChildrenBatched(span_id);
+    return;
+  }
+
+  for (int i = 0; i < targets_.size(); i++) {
+    outstanding_children++;
+    // 10000 as a hard code interval between parent and child spans
+    ChildCall* call =
+      targets_[i]->client->Call(this, targets_[i]->outcall, 10000 + span_id, ChildFanoutKey(i));
+    children_.push_back(call);
+    uint64_t hedge_delay = target_calls_[i]->HedgeDelay(targets_[i]);
+    if (hedge_delay > 0) {
+      call->ArmHedge(target_calls_[i], targets_[i], hedge_delay);
+    }
+    span_id += 2;
+  }
+}
+
+// Groups the calls to each server into one ExecBatch RPC
+void Request::InvokeChildrenBatched(uint64_t span_id) {
+  std::vector<ChildBatchCall*> batches(targets_.size(), nullptr);
+  std::vector<ChildBatchCall*> distinct_batches;
+  for (int i = 0; i < targets_.size(); i++) {
+    if (batches[i] != nullptr) continue;
+    for (int j = i + 1; j < targets_.size(); j++) {
+      if (targets_[j]->client == targets_[i]->client) {
+        if (batches[i] == nullptr) {
+          batches[i] = HandlerThread::current().childbatch_pool.Acquire();
+          batches[i]->Start(targets_[i]->client, this);
+          distinct_batches.push_back(batches[i]);
+        }
+        batches[j] = batches[i];
+      }
+    }
+  }
+
+  for (int i = 0; i < targets_.size(); i++) {
+    outstanding_children++;
+    // 10000 as a hard code interval between parent and child spans
+    children_.push_back(
+      targets_[i]->client->Call(this, targets_[i]->outcall, 10000 + span_id, ChildFanoutKey(i),
+                                batches[i]));
+    span_id += 2;
+  }
+
+  // Send each batch once, after all of its calls have been added
+  for (auto batch : distinct_batches) {
+    batch->SendCall();
+  }
+}
+
+// Each child gets a distinct key derived from ours and its position
+uint64_t Request::ChildFanoutKey(int index) {
+  return mix64(request_->fanout_key() + index + 1);
 }
 
 void Request::ChildResponseReceived(ChildCall* call, bool ok) {
+  PerfStage perf_stage(perf_sampled_, PerfTotalsFor());
+  std::unique_lock<std::mutex> lock(children_mutex_);
   std::shared_ptr<Scope> scope;
   OPENTELEMETRY(
     scope = std::make_shared<Scope>(request_span);
   )
 
+  // Of a hedged call's two attempts, the first to succeed wins, and the
+  // other is cancelled.  A failed attempt loses if the other is still out.
+  std::replace(children_.begin(), children_.end(), call, (ChildCall*) nullptr);
+  bool failed = !ok || !call->status.ok();
+  if (call->lost_ || (failed && call->sibling_ != nullptr)) {
+    if (call->sibling_ != nullptr) {
+      call->sibling_->sibling_ = nullptr;
+    }
+    OPENTELEMETRY(
+      call->childcall_span->AddEvent(call->lost_ ? "Hedged call lost" : "Hedged call failed");
+    )
+    HINDSIGHT(
+      hs_->LogSpanEvent(call->id_, call->lost_ ? "Hedged call lost" : "Hedged call failed");
+      hs_->LogSpanEnd(call->id_);
+    )
+    call->Release();
+    lock.unlock();
+    Release();
+    return;
+  }
+  call->answered_ = true;
+  if (call->hedge_armed_) {
+    call->hedge_alarm_.Cancel();
+  }
+  if (call->sibling_ != nullptr) {
+    call->sibling_->lost_ = true;
+    call->sibling_->sibling_ = nullptr;
+    call->sibling_->Cancel();
+    if (call->hedge_) {
+      handler_->counters.hedge_wins++;
+    }
+    OPENTELEMETRY(
+      call->childcall_span->AddEvent("Hedged call won");
+    )
+    HINDSIGHT(
+      hs_->LogSpanEvent(call->id_, "Hedged call won");
+    )
+  }
+
 
   if (!ok) {
     OPENTELEMETRY(
@@ -695,7 +1599,7 @@ void Request::ChildResponseReceived(ChildCall* call, bool ok) {
       hs_->LogSpanEvent(call->id_, "Failed to invoke child");
     )
     REQUESTDEBUG(
-      if (request_.debug()) {
+      if (request_->debug()) {
         std::cout << "[DEBUG] Failed to invoke child " << *call->outcall_ << std::endl;
       }
     )
@@ -709,17 +1613,17 @@ void Request::ChildResponseReceived(ChildCall* call, bool ok) {
 
     if (call->status.ok()) {
       OPENTELEMETRY(
-        call->childcall_span->SetAttribute("Response payload", call->reply.payload());
+        call->childcall_span->SetAttribute("Response payload", call->reply->payload());
         call->childcall_span->SetStatus(opentelemetry::trace::StatusCode::kOk, "Child response was OK");
       )
       HINDSIGHT(
-        hs_->LogSpanAttributeStr(call->id_, "Response payload", call->reply.payload());
+        hs_->LogSpanAttributeStr(call->id_, "Response payload", call->reply->payload());
         hs_->LogSpanStatus(call->id_, (int) opentelemetry::trace::StatusCode::kOk, "Child response was OK");
       )
       REQUESTDEBUG(
-        if (request_.debug()) {
+        if (request_->debug()) {
           std::cout << "[DEBUG] Child response received from " << *call->outcall_ << std::endl;
-          std::cout << "[DEBUG] Child response payload: " << call->reply.payload() << std::endl;
+          std::cout << "[DEBUG] Child response payload: " << call->reply->payload() << std::endl;
         }
       )
 
@@ -731,7 +1635,7 @@ void Request::ChildResponseReceived(ChildCall* call, bool ok) {
         hs_->LogSpanStatus(call->id_, (int) opentelemetry::trace::StatusCode::kError, "Child response was not OK");
       )
       REQUESTDEBUG(
-        if (request_.debug()) {
+        if (request_->debug()) {
           std::cout << "[DEBUG] Child RPC failed " << *call->outcall_ << std::endl;
         }
       )
@@ -742,15 +1646,64 @@ void Request::ChildResponseReceived(ChildCall* call, bool ok) {
     hs_->LogSpanEnd(call->id_);
   )
   
-  delete call;
+  call->Release();
+  lock.unlock();
 
-  outstanding_children--;
-  if (outstanding_children == 0) {
-    Complete();
+  ChildDone();
+}
+
+// A child call's hedge timer fired, or was cancelled because the call was
+// answered.  If it is still unanswered, send a duplicate to another instance.
+// The duplicate holds a reference to the request until it either wins or
+// loses, since the loser may answer after the request has completed.
+void Request::HedgeChild(ChildCall* call, bool ok) {
+  std::unique_lock<std::mutex> lock(children_mutex_);
+  call->hedge_armed_ = false;
+  if (ok && !call->answered_ && !Abandoned()) {
+    const RouteTarget* target = call->route_call_->PickHedge(HandlerThread::current().rng, call->target_);
+    refs_++;
+    ChildCall* hedge = target->client->Call(this, target->outcall, call->id_ + hedge_span_offset,
+                                            call->request->fanout_key());
+    hedge->hedge_ = true;
+    hedge->sibling_ = call;
+    call->sibling_ = hedge;
+    children_.push_back(hedge);
+    handler_->counters.hedged++;
+
+    OPENTELEMETRY(
+      call->childcall_span->AddEvent("Hedging call");
+      hedge->childcall_span->SetAttribute("Hedge", (int64_t) 1);
+    )
+    HINDSIGHT(
+      hs_->LogSpanEvent(call->id_, "Hedging call");
+      hs_->LogSpanAttribute(hedge->id_, "Hedge", 1);
+    )
+  }
+  call->Release();
+  lock.unlock();
+  Release();
+}
+
+// Completes the request once all children, and EndProcess, are done with it.
+// A request that finishes after its deadline fails, even if it wasn't
+// abandoned in time.
+void Request::ChildDone() {
+  if (--outstanding_children == 0) {
+    if (!Abandoned()) {
+      Complete();
+    } else if (deadline_ != std::chrono::system_clock::time_point::max() &&
+               std::chrono::system_clock::now() > deadline_) {
+      Complete(Status(grpc::StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded"));
+    } else {
+      Complete(Status(grpc::StatusCode::CANCELLED, "Request cancelled"));
+    }
   }
 }
 
-void Request::Complete() { 
+void Request::Complete(const Status& status) {
+  completed_at_ = nanos();
+
+  std::unique_lock<std::mutex> lock(children_mutex_);
   nostd::shared_ptr<Span> span;
   std::shared_ptr<Scope> scope;
   OPENTELEMETRY(
@@ -767,17 +1720,18 @@ void Request::Complete() {
     hs_->LogSpanKind(span_id, 0);
   )
 
-  std::string prefix("Hello ");
-  reply_.set_payload(prefix + request_.api());
+  if (status.ok()) {
+    std::string prefix("Hello ");
+    reply_->set_payload(prefix + route_->api->name);
+  }
+  reply_->set_binary_trace_context(true);
 
   HINDSIGHT(
-    reply_.mutable_hindsight()->set_trace_id(hs_->trace_id);
-    reply_.mutable_hindsight()->add_breadcrumb(handler_->local_address);
+    reply_->mutable_hindsight()->set_trace_id(hs_->trace_id);
+    reply_->mutable_hindsight()->add_breadcrumb(handler_->local_address);
   )
 
-  handler_->server_->finishing++;
-  status_ = FINISH;
-  responder_.Finish(reply_, Status::OK, this);
+  handler_->counters.finishing++;
 
   OPENTELEMETRY(
     span->AddEvent("Sending RPC response");
@@ -788,37 +1742,62 @@ void Request::Complete() {
     hs_->LogSpanEnd(span_id);
     hs_->LogSpanEnd(hs_->parent_span_id + 1);
   )
+  lock.unlock();
+
+  // Another handler thread may pick up FINISH and recycle the request as
+  // soon as it is queued, so this comes last
+  status_ = FINISH;
+  if (batch_ != nullptr) {
+    // Batched calls have no responder; finish on the CQ like any other request
+    batch_->SetStatus(batch_index_, status);
+    alarm_.Set(handler_->cq_, gpr_time_0(GPR_CLOCK_MONOTONIC), this);
+  } else {
+    responder_->Finish(*reply_, status, this);
+  }
+}
+
+// Fails the RPC immediately because the handler is at its concurrency limit.
+// No spans are recorded; the caller sees RESOURCE_EXHAUSTED.
+void Request::Reject() {
+  handler_->counters.rejected++;
+  status_ = REJECTED;
+  Status status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Server overloaded");
+  if (batch_ != nullptr) {
+    batch_->SetStatus(batch_index_, status);
+    alarm_.Set(handler_->cq_, gpr_time_0(GPR_CLOCK_MONOTONIC), this);
+  } else {
+    responder_->FinishWithError(status, this);
+  }
 }
 
 SpanContext Request::extractContextFromRPC() {
 #ifdef PROPAGATOR
   // compare with trace metadata extracted from the received RPC
   auto defaults = opentelemetry::context::Context{};
-  auto carrier = GrpcServerCarrier(&this->ctx_);
-  auto received_context = handler_->propagator_->Extract(carrier, defaults);
+  opentelemetry::context::Context received_context;
+  if (batch_ != nullptr) {
+    auto carrier = GrpcBatchedCallCarrier(request_->mutable_metadata());
+    received_context = handler_->propagator_->Extract(carrier, defaults);
+  } else {
+    auto carrier = GrpcServerCarrier(this->ctx_);
+    received_context = handler_->propagator_->Extract(carrier, defaults);
+  }
   auto remote_span = opentelemetry::trace::GetSpan(received_context);
 #endif
 
-  auto otel_context = request_.otel();
-  auto trace_id_hex = nostd::string_view(otel_context.trace_id());
-  auto span_id_hex = nostd::string_view(otel_context.span_id());
+  auto &otel_context = request_->otel();
   bool sample_flag = otel_context.sample();
 
-  if (!detail::IsValidHex(trace_id_hex) || !detail::IsValidHex(span_id_hex)) {
-    // throw exception
-  }
-
   uint8_t trace_id[16];
   uint8_t span_id[8];
-  if (!detail::HexToBinary(trace_id_hex, trace_id, sizeof(trace_id)) ||
-      !detail::HexToBinary(span_id_hex, span_id, sizeof(span_id))) {
+  if (!get_otel_context_ids(otel_context, trace_id, span_id)) {
     // throw exception
   }
 
   uint8_t flags = sample_flag;
   auto span_context = SpanContext(TraceId(trace_id), SpanId(span_id), TraceFlags(flags), true);
 
-  if (!request_.mutable_hindsight()->triggerflag()) {
+  if (!request_->mutable_hindsight()->triggerflag()) {
     // compare span_context withremote_span
     // assert(span_context == remote_span);
   }
@@ -829,22 +1808,182 @@ SpanContext Request::extractContextFromRPC() {
   return span_context;
 }
 
-ChildClient::ChildClient(std::string address) : address(address),
-  channel(grpc::CreateChannel(address, grpc::InsecureChannelCredentials())),
-  stub(HindsightGRPC::NewStub(channel)) {}
+ClientChannel::ClientChannel(std::string address, int index) : outstanding(0) {
+  // Channels with identical args share subchannels, and so connections, so
+  // give each channel its own index and its own subchannel pool
+  grpc::ChannelArguments args;
+  args.SetInt("microbricks.channel_index", index);
+  args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+  channel = grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
+  stub = HindsightGRPC::NewStub(channel);
+}
+
+ChildClient::ChildClient(std::string address, int nchannels, ChannelSelection selection,
+                         int limit, int queue_limit) :
+  address(address), selection(selection), next_channel(0), binary_context(false),
+  outstanding(0), latency_ewma(0), latency_count(0), limit(limit), queue_limit(queue_limit),
+  sending(0), shut_down(false), queued(0), queued_ns(0), rejected(0) {
+  for (int i = 0; i < latency_samples; i++) {
+    recent_latency[i] = 0;
+  }
+  for (int i = 0; i < std::max(nchannels, 1); i++) {
+    channels.push_back(std::unique_ptr<ClientChannel>(new ClientChannel(address, i)));
+  }
+}
 
 ChildClient::~ChildClient() {}
 
-ChildCall* ChildClient::Call(Request* parent, Outcall* outcall, int id) {
-  //TODO: Modify this to accept an Outcall parameter
-  ChildCall* call = new ChildCall(this, parent, outcall, id);
-  call->SendCall();
+ClientChannel* ChildClient::PickChannel() {
+  ClientChannel* picked;
+  if (channels.size() == 1) {
+    picked = channels[0].get();
+  } else if (selection == ROUND_ROBIN) {
+    picked = channels[next_channel++ % channels.size()].get();
+  } else {
+    // Least outstanding calls, starting the scan at a rotating channel so
+    // that ties are spread out
+    size_t start = next_channel++;
+    picked = channels[start % channels.size()].get();
+    for (size_t i = 1; i < channels.size(); i++) {
+      ClientChannel* channel = channels[(start + i) % channels.size()].get();
+      if (channel->outstanding < picked->outstanding) {
+        picked = channel;
+      }
+    }
+  }
+  picked->outstanding++;
+  return picked;
+}
+
+// An exponentially-weighted moving average with weight 1/8 for new calls.
+// Concurrent updates may lose a sample, which doesn't matter for an average.
+void ChildClient::RecordLatency(uint64_t latency_ns) {
+  uint64_t average = latency_ewma.load(std::memory_order_relaxed);
+  if (average == 0) {
+    average = latency_ns;
+  } else {
+    average = average - average / 8 + latency_ns / 8;
+  }
+  latency_ewma.store(std::max<uint64_t>(average, 1), std::memory_order_relaxed);
+
+  uint64_t slot = latency_count.fetch_add(1, std::memory_order_relaxed) % latency_samples;
+  recent_latency[slot].store(latency_ns, std::memory_order_relaxed);
+}
+
+// Only used when arming a hedge, so a copy and a selection are cheap enough
+uint64_t ChildClient::LatencyPercentile(double percentile) {
+  int n = std::min<uint64_t>(latency_count.load(std::memory_order_relaxed), latency_samples);
+  if (n < latency_samples / 4) {
+    return 0;
+  }
+  uint64_t latencies[latency_samples];
+  for (int i = 0; i < n; i++) {
+    latencies[i] = recent_latency[i].load(std::memory_order_relaxed);
+  }
+  int k = std::min(n - 1, std::max(0, (int) (percentile / 100 * n)));
+  std::nth_element(latencies, latencies + k, latencies + n);
+  return latencies[k];
+}
+
+ChildCall* ChildClient::Call(Request* parent, Outcall* outcall, int id, uint64_t fanout_key,
+                             ChildBatchCall* batch) {
+  // Child calls come from the calling thread's pool, and return to the pool
+  // of whichever handler thread completes them
+  ChildCall* call = HandlerThread::current().childcall_pool.Acquire();
+  outstanding++;
+  call->Start(this, parent, outcall, id, batch);
+  call->request->set_fanout_key(fanout_key);
+  if (limit == 0 || batch != nullptr) {
+    call->SendCall();
+    return call;
+  }
+
+  std::unique_lock<std::mutex> lock(bulkhead_mutex);
+  if (sending < limit) {
+    sending++;
+    lock.unlock();
+    call->admitted_ = true;
+    call->SendCall();
+
+  } else if (!shut_down && waiting.size() < (size_t) queue_limit) {
+    // The caller holds the parent's children_mutex_, so the call can't be
+    // sent until we're done with it here
+    call->queued_at_ = nanos();
+    waiting.push_back(call);
+    lock.unlock();
+    queued++;
+    OPENTELEMETRY(
+      call->childcall_span->AddEvent("Waiting for child server");
+    )
+    HINDSIGHT(
+      parent->hs_->LogSpanEvent(id, "Waiting for child server");
+    )
+
+  } else {
+    lock.unlock();
+    rejected++;
+    call->Reject();
+  }
   return call;
 }
 
-ChildCall::ChildCall(ChildClient* child, Request* parent, Outcall* outcall, int id) : child_(child),
-  parent_(parent), outcall_(outcall), id_(id) {
-  
+void ChildClient::CallFinished() {
+  ChildCall* next = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(bulkhead_mutex);
+    if (waiting.empty()) {
+      sending--;
+    } else {
+      next = waiting.front();
+      waiting.pop_front();
+    }
+  }
+  if (next != nullptr) {
+    next->SendQueued();
+  }
+}
+
+void ChildClient::Shutdown() {
+  std::deque<ChildCall*> abandoned;
+  {
+    std::lock_guard<std::mutex> lock(bulkhead_mutex);
+    shut_down = true;
+    abandoned.swap(waiting);
+  }
+  for (ChildCall* call : abandoned) {
+    rejected++;
+    call->RejectQueued();
+  }
+}
+
+ChildCall::ChildCall() : child_(nullptr), parent_(nullptr), batch_(nullptr), channel_(nullptr),
+  request(nullptr), reply(nullptr),
+  outcall_(nullptr), id_(0), start_time_(0), route_call_(nullptr), target_(nullptr),
+  sibling_(nullptr), hedge_(false), answered_(false), lost_(false),
+  hedge_callback_(this), hedge_armed_(false), refs_(0), admitted_(false), queued_at_(0) {
+  context = new (&context_storage_) ClientContext();
+}
+
+ChildCall::~ChildCall() {
+  response_reader.reset();
+  context->~ClientContext();
+}
+
+void ChildCall::Start(ChildClient* child, Request* parent, Outcall* outcall, int id, ChildBatchCall* batch) {
+  child_ = child;
+  parent_ = parent;
+  outcall_ = outcall;
+  id_ = id;
+  batch_ = batch;
+  start_time_ = nanos();
+  refs_ = 1;
+  if (batch != nullptr) {
+    request = batch->AddCall(this);
+  } else {
+    request = google::protobuf::Arena::CreateMessage<ExecRequest>(&parent->arena_);
+  }
+  reply = google::protobuf::Arena::CreateMessage<ExecReply>(&parent->arena_);
+
   OPENTELEMETRY(
     this->childcall_span = parent_->handler_->tracer_->StartSpan("HindsightGRPC/ChildCall");
   )
@@ -857,7 +1996,90 @@ ChildCall::ChildCall(ChildClient* child, Request* parent, Outcall* outcall, int
   )
 }
 
-ChildCall::~ChildCall() {}
+// Resets the call and returns it to the current handler thread's pool
+void ChildCall::Recycle() {
+  // The messages belong to the parent request's arena
+  request = nullptr;
+  reply = nullptr;
+  status = Status();
+
+  response_reader.reset();
+  context->~ClientContext();
+  context = new (&context_storage_) ClientContext();
+
+  childcall_span = nostd::shared_ptr<Span>();
+  child_ = nullptr;
+  parent_ = nullptr;
+  batch_ = nullptr;
+  channel_ = nullptr;
+  outcall_ = nullptr;
+  route_call_ = nullptr;
+  target_ = nullptr;
+  sibling_ = nullptr;
+  hedge_ = false;
+  answered_ = false;
+  lost_ = false;
+  hedge_armed_ = false;
+  admitted_ = false;
+  queued_at_ = 0;
+
+  HandlerThread::current().childcall_pool.Release(this);
+}
+
+void ChildCall::Release() {
+  if (--refs_ == 0) {
+    Recycle();
+  }
+}
+
+// Called on whichever thread freed the slot, so take the parent's lock for
+// its trace state
+void ChildCall::SendQueued() {
+  std::lock_guard<std::mutex> lock(parent_->children_mutex_);
+  admitted_ = true;
+  start_time_ = nanos();
+  int64_t waited = start_time_ - queued_at_;
+  child_->queued_ns += waited;
+
+  OPENTELEMETRY(
+    childcall_span->SetAttribute("QueueWait", waited);
+  )
+  HINDSIGHT(
+    parent_->hs_->LogSpanAttribute(id_, "QueueWait", waited);
+  )
+  SendCall();
+}
+
+// Called on whichever thread shut the client down, so take the parent's lock
+// for its trace state
+void ChildCall::RejectQueued() {
+  std::lock_guard<std::mutex> lock(parent_->children_mutex_);
+  Reject();
+}
+
+// Completes on the parent's CQ like a response, since the caller holds the
+// parent's children_mutex_
+void ChildCall::Reject() {
+  OPENTELEMETRY(
+    childcall_span->AddEvent("Child server queue full");
+  )
+  HINDSIGHT(
+    parent_->hs_->LogSpanEvent(id_, "Child server queue full");
+  )
+  status = Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Too many calls to " + child_->address);
+  alarm_.Set(parent_->handler_->cq_, gpr_time_0(GPR_CLOCK_MONOTONIC), this);
+}
+
+void ChildCall::ArmHedge(const RouteCall* route_call, const RouteTarget* target, uint64_t delay_ns) {
+  route_call_ = route_call;
+  target_ = target;
+  hedge_armed_ = true;
+  refs_++;
+  parent_->refs_++;
+  hedge_alarm_.Set(parent_->handler_->cq_,
+    gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_nanos(delay_ns, GPR_TIMESPAN)),
+    &hedge_callback_);
+}
 
 void ChildCall::SendCall() {
   std::shared_ptr<Scope> childcall_scope;
@@ -888,54 +2110,68 @@ void ChildCall::SendCall() {
   )
 
   REQUESTDEBUG(
-    if (parent_->request_.debug()) {
+    if (parent_->request_->debug()) {
       std::cout << "[DEBUG] Making Child RPC call to " << outcall_ << " " << *outcall_ << std::endl;
     }
   )
 
-  // Create the RPC request
-  ExecRequest request;
-  request.set_api(outcall_->api_name);
-  request.set_payload("payload");
-  request.set_interval(parent_->request_.interval());
+  // Fill in the RPC request
+  request->set_api(outcall_->api_name);
+  request->set_api_id(outcall_->api_id);
+  request->set_priority(outcall_->priority);
+  request->set_payload("payload");
+  request->set_interval(parent_->request_->interval());
 
 
   /* Context propagation */
   REQUESTDEBUG(
-    request.set_debug(parent_->request_.debug());
+    request->set_debug(parent_->request_->debug());
   )
   OPENTELEMETRY(
     auto current_ctx = opentelemetry::context::RuntimeContext::GetCurrent();
 #ifdef PROPAGATOR
-    // Inject the OT context into the gRPC context
-    GrpcClientCarrier carrier(&context);
-    parent_->handler_->propagator_->Inject(carrier, current_ctx);
-    context.AddMetadata("breadcrumb", parent_->handler_->local_address);
+    if (batch_ != nullptr) {
+      // Batched calls share the batch's gRPC context, so each carries its own
+      GrpcBatchedCallCarrier carrier(request->mutable_metadata());
+      parent_->handler_->propagator_->Inject(carrier, current_ctx);
+      (*request->mutable_metadata())["breadcrumb"] = parent_->handler_->local_address;
+    } else {
+      // Inject the OT context into the gRPC context
+      GrpcClientCarrier carrier(context);
+      parent_->handler_->propagator_->Inject(carrier, current_ctx);
+      context->AddMetadata("breadcrumb", parent_->handler_->local_address);
+    }
 #endif
     // inject current span id into the request
+    // using the binary form once the child has told us it understands it
     SpanContext span_context = opentelemetry::trace::GetSpan(current_ctx)->GetContext();
-    char tid_buffer[32];
-    span_context.trace_id().ToLowerBase16(nostd::span<char, 32>{&tid_buffer[0], 32});
-    request.mutable_otel()->set_trace_id(std::string(tid_buffer, 32));
-    char sid_buffer[16];
-    span_context.span_id().ToLowerBase16(nostd::span<char, 16>{&sid_buffer[0], 16});
-    request.mutable_otel()->set_span_id(std::string(sid_buffer, 16));
-    request.mutable_otel()->set_sample(span_context.IsSampled() ? true : false);
+    set_otel_context_ids(request->mutable_otel(), span_context.trace_id(),
+                         span_context.span_id(), child_->binary_context);
+    request->mutable_otel()->set_sample(span_context.IsSampled() ? true : false);
   )
   HINDSIGHT(
-    request.mutable_hindsight()->set_trace_id(parent_->hs_->trace_id);
-    request.mutable_hindsight()->set_span_id(parent_->hs_->parent_span_id + 2);
-    request.mutable_hindsight()->add_breadcrumb(
+    request->mutable_hindsight()->set_trace_id(parent_->hs_->trace_id);
+    request->mutable_hindsight()->set_span_id(parent_->hs_->parent_span_id + 2);
+    request->mutable_hindsight()->add_breadcrumb(
         parent_->handler_->local_address);
   )
 
-  // Start the call using the parent request's completion queue
-  response_reader = child_->stub->PrepareAsyncExec(&context, request,
-    parent_->handler_->cq_);
-  response_reader->StartCall();
+  // Pass on the parent's deadline
+  if (parent_->deadline_ != std::chrono::system_clock::time_point::max()) {
+    context->set_deadline(parent_->deadline_);
+  }
 
-  // Register this object's Proceed method as the callback upon completion
-  response_reader->Finish(&reply, &status, this);
+  // Batched calls are sent by their batch
+  if (batch_ == nullptr) {
+    // Start the call using the parent request's completion queue
+    channel_ = child_->PickChannel();
+    response_reader = channel_->stub->PrepareAsyncExec(context, *request,
+      parent_->handler_->cq_);
+    response_reader->StartCall();
+
+    // Register this object's Proceed method as the callback upon completion
+    response_reader->Finish(reply, &status, this);
+  }
 
   OPENTELEMETRY(
     span->AddEvent("Child RPC call initiated");
@@ -949,7 +2185,287 @@ void ChildCall::SendCall() {
 
 // The callback invoked by gRPC when a response is received
 void ChildCall::Proceed(bool ok)  {
+  if (channel_ != nullptr) {
+    channel_->outstanding--;
+  }
+  child_->outstanding--;
+  if (admitted_) {
+    child_->CallFinished();
+  }
+  if (ok && status.ok()) {
+    child_->RecordLatency(nanos() - start_time_);
+  }
+
+  // Switch to binary trace context ids once the child says it understands them
+  if (ok && status.ok() && reply->binary_trace_context() && !child_->binary_context) {
+    child_->binary_context = true;
+  }
   parent_->ChildResponseReceived(this, ok);
 }
 
+void ChildCall::Cancel() {
+  if (batch_ != nullptr) {
+    batch_->context->TryCancel();
+  } else {
+    context->TryCancel();
+  }
+}
+
+BatchRequest::BatchRequest(ServerHandler* handler) : handler_(handler),
+    status_(CREATE), outstanding_calls(0), done_callback_(this), refs_(0) {
+  ctx_ = new (&ctx_storage_) ServerContext();
+  responder_ = new (&responder_storage_) Responder(ctx_);
+}
+
+BatchRequest::~BatchRequest() {
+  responder_->~Responder();
+  ctx_->~ServerContext();
+}
+
+void BatchRequest::Start() {
+  status_ = CREATE;
+  // Invoke the serving logic right away.
+  Proceed(true);
+}
+
+// Resets the batch for the next RPC and returns it to the handler's pool
+void BatchRequest::Recycle() {
+  request_.Clear();
+  reply_.Clear();
+
+  responder_->~Responder();
+  ctx_->~ServerContext();
+  ctx_ = new (&ctx_storage_) ServerContext();
+  responder_ = new (&responder_storage_) Responder(ctx_);
+
+  outstanding_calls = 0;
+  calls_.clear();
+  HandlerThread::current().batch_pool.Release(this);
+}
+
+void BatchRequest::Release() {
+  if (--refs_ == 0) {
+    Recycle();
+  }
+}
+
+// If the caller cancelled the RPC, or its deadline passed, cancel the calls
+// that haven't finished, as for a Request
+void BatchRequest::Done() {
+  if (ctx_->IsCancelled()) {
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    for (Request* call : calls_) {
+      if (call != nullptr) {
+        call->Cancel();
+      }
+    }
+  }
+  Release();
+}
+
+void BatchRequest::Proceed(bool ok) {
+  if (status_ == CREATE) {
+    status_ = PROCESS;
+    // FINISH, and gRPC's notification that it is done with the RPC
+    refs_ = 2;
+    ctx_->AsyncNotifyWhenDone(&done_callback_);
+    handler_->server_->service_.RequestExecBatch(ctx_, &request_, responder_,
+      handler_->cq_, handler_->cq_, this);
+
+  } else if (status_ == PROCESS) {
+    if (!ok) {
+      // The completion queue is shutting down
+      Release();
+      return;
+    }
+
+    // Accept the next batch
+    HandlerThread::current().batch_pool.Acquire(handler_)->Start();
+
+    REQUESTDEBUG(
+      if (request_.calls_size() > 0 && request_.calls(0).debug()) {
+        std::cout << "[DEBUG] Received batch of " << request_.calls_size()
+                  << " calls" << std::endl;
+      }
+    )
+
+    if (request_.calls_size() == 0) {
+      status_ = FINISH;
+      responder_->Finish(reply_, Status::OK, this);
+      return;
+    }
+
+    // Calls can finish on other handler threads before all have started, so
+    // hold an extra count until they have.  Each call only touches its own
+    // reply and status.
+    outstanding_calls = request_.calls_size() + 1;
+    for (int i = 0; i < request_.calls_size(); i++) {
+      reply_.add_replies();
+      reply_.add_statuses();
+    }
+    // All calls are registered before any starts, so that a cancellation
+    // reaches each of them; calls_[i] only changes once call i finishes
+    {
+      std::lock_guard<std::mutex> lock(calls_mutex_);
+      for (int i = 0; i < request_.calls_size(); i++) {
+        calls_.push_back(HandlerThread::current().request_pool.Acquire(handler_));
+      }
+    }
+    for (int i = 0; i < request_.calls_size(); i++) {
+      calls_[i]->StartBatched(this, i);
+    }
+    CallDone();
+
+  } else if (status_ == FINISH) {
+    Release();
+
+  } else {
+    std::cout << "Unexpected transition" << std::endl;
+  }
+}
+
+void BatchRequest::SetStatus(int index, const Status& status) {
+  BatchCallStatus* call_status = reply_.mutable_statuses(index);
+  call_status->set_code(status.error_code());
+  call_status->set_message(status.error_message());
+}
+
+void BatchRequest::CallFinished(Request* call, bool ok) {
+  {
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    calls_[call->batch_index_] = nullptr;
+  }
+  if (ok) {
+    reply_.mutable_replies(call->batch_index_)->CopyFrom(*call->reply_);
+  }
+  CallDone();
+}
+
+// Replies once all calls have finished
+void BatchRequest::CallDone() {
+  if (--outstanding_calls == 0) {
+    status_ = FINISH;
+    responder_->Finish(reply_, Status::OK, this);
+  }
+}
+
+StatsCall::StatsCall(ServerImpl* server, ServerCompletionQueue* cq) :
+    server_(server), cq_(cq), responder_(&ctx_), status_(CREATE) {
+  // Invoke the serving logic right away.
+  Proceed(true);
+}
+
+void StatsCall::Proceed(bool ok) {
+  if (status_ == CREATE) {
+    status_ = PROCESS;
+    server_->service_.RequestStats(&ctx_, &request_, &responder_, cq_, cq_, this);
+
+  } else if (status_ == PROCESS) {
+    if (!ok) {
+      // The completion queue is shutting down
+      delete this;
+      return;
+    }
+
+    // Accept the next call
+    new StatsCall(server_, cq_);
+
+    server_->GetStats(&reply_);
+    status_ = FINISH;
+    responder_.Finish(reply_, Status::OK, this);
+
+  } else if (status_ == FINISH) {
+    delete this;
+
+  } else {
+    std::cout << "Unexpected transition" << std::endl;
+  }
+}
+
+ChildBatchCall::ChildBatchCall() : child_(nullptr), parent_(nullptr), channel_(nullptr),
+    request(nullptr), reply(nullptr) {
+  context = new (&context_storage_) ClientContext();
+}
+
+ChildBatchCall::~ChildBatchCall() {
+  response_reader.reset();
+  context->~ClientContext();
+}
+
+void ChildBatchCall::Start(ChildClient* child, Request* parent) {
+  child_ = child;
+  parent_ = parent;
+  request = google::protobuf::Arena::CreateMessage<ExecBatchRequest>(&parent->arena_);
+  reply = google::protobuf::Arena::CreateMessage<ExecBatchReply>(&parent->arena_);
+}
+
+// Resets the batch and returns it to the current handler thread's pool
+void ChildBatchCall::Recycle() {
+  // The messages belong to the parent request's arena
+  request = nullptr;
+  reply = nullptr;
+  status = Status();
+  calls.clear();
+
+  response_reader.reset();
+  context->~ClientContext();
+  context = new (&context_storage_) ClientContext();
+
+  child_ = nullptr;
+  parent_ = nullptr;
+  channel_ = nullptr;
+
+  HandlerThread::current().childbatch_pool.Release(this);
+}
+
+ExecRequest* ChildBatchCall::AddCall(ChildCall* call) {
+  calls.push_back(call);
+  return request->add_calls();
+}
+
+void ChildBatchCall::SendCall() {
+  REQUESTDEBUG(
+    if (parent_->request_->debug()) {
+      std::cout << "[DEBUG] Sending batch of " << calls.size()
+                << " child calls to " << child_->address << std::endl;
+    }
+  )
+
+  // Pass on the parent's deadline
+  if (parent_->deadline_ != std::chrono::system_clock::time_point::max()) {
+    context->set_deadline(parent_->deadline_);
+  }
+
+  // Start the call using the parent request's completion queue
+  channel_ = child_->PickChannel();
+  response_reader = channel_->stub->PrepareAsyncExecBatch(context, *request,
+    parent_->handler_->cq_);
+  response_reader->StartCall();
+  response_reader->Finish(reply, &status, this);
+}
+
+// Hands each call its reply and status, then completes the calls as if each
+// had been sent on its own
+void ChildBatchCall::Proceed(bool ok) {
+  channel_->outstanding--;
+  for (int i = 0; i < (int) calls.size(); i++) {
+    ChildCall* call = calls[i];
+    call->status = status;
+    if (ok && status.ok()) {
+      if (i < reply->replies_size()) {
+        // Both replies are on the parent's arena, so this doesn't copy
+        call->reply->Swap(reply->mutable_replies(i));
+      } else {
+        call->status = Status(grpc::StatusCode::INTERNAL, "Missing reply in batch");
+      }
+      if (i < reply->statuses_size() && reply->statuses(i).code() != grpc::StatusCode::OK) {
+        call->status = Status((grpc::StatusCode) reply->statuses(i).code(),
+                              reply->statuses(i).message());
+      }
+    }
+    call->Proceed(ok);
+  }
+  Recycle();
+}
+
 }  // namespace hindsightgrpc
@@ -7,6 +7,7 @@
 #define SRC_HINDSIGHTGRPC_SERVER_H_
 
 #include <grpc/support/log.h>
+#include <grpcpp/alarm.h>
 #include <grpcpp/grpcpp.h>
 #include <json.hpp>
 
@@ -16,14 +17,19 @@
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <chrono>
+#include <deque>
 #include <mutex>
 #include <map>
+#include <type_traits>
 
 
 extern "C" {
   #include "hindsight.h"
 }
 
+#include <google/protobuf/arena.h>
+
 #include "hindsightgrpc.grpc.pb.h"
 #include "opentelemetry/trace/provider.h"
 #include "opentelemetry/trace/tracer.h"
@@ -31,6 +37,15 @@ extern "C" {
 #include "opentelemetry/context/propagation/text_map_propagator.h"
 
 #include "topology.h"
+#include "work_engine.h"
+#include "compute_pool.h"
+#include "concurrency_limiter.h"
+#include "histogram.h"
+#include "object_pool.h"
+#include "perf_counters.h"
+#include "priority_queue.h"
+#include "random.h"
+#include "routing.h"
 #include "../tracing/opentelemetry.h"
 #include "../tracing/hindsight_extensions.h"
 
@@ -48,6 +63,10 @@ using grpc::Status;
 using hindsightgrpc::HindsightGRPC;
 using hindsightgrpc::ExecRequest;
 using hindsightgrpc::ExecReply;
+using hindsightgrpc::ExecBatchRequest;
+using hindsightgrpc::ExecBatchReply;
+using hindsightgrpc::StatsRequest;
+using hindsightgrpc::StatsReply;
 using json = nlohmann::json;
 
 namespace nostd = opentelemetry::nostd;
@@ -60,6 +79,12 @@ namespace hindsightgrpc {
 
 class ServerHandler;
 class ChildClient;
+class Request;
+class ChildCall;
+class BatchRequest;
+class StatsCall;
+class ChildBatchCall;
+class GemmBatcher;
 
 // Used by command-line to set hindsight tracing on or off
 extern void set_hindsight_enabled(bool is_enabled);
@@ -67,25 +92,63 @@ extern void set_hindsight_enabled(bool is_enabled);
 // Used by command-line to set opentelemetry on or off
 extern void set_opentelemetry_enabled(bool is_enabled);
 
+/* Lifecycle counters of a handler's requests.  Each handler has its own,
+padded so that no other data shares its cache lines, so that handlers never
+write to shared cache lines on the request path.  PrintThread sums them. */
+struct HandlerCounters {
+  HandlerCounters() : awaiting(0), processing(0), awaitingchildren(0),
+    finishing(0), completed(0), rejected(0), queued(0), hedged(0), hedge_wins(0),
+    tracing_ns(0) {}
+
+  char pad_before_[64];
+  std::atomic_uint64_t awaiting;
+  std::atomic_uint64_t processing;
+  std::atomic_uint64_t awaitingchildren;
+  std::atomic_uint64_t finishing;
+  std::atomic_uint64_t completed;
+  std::atomic_uint64_t rejected;
+  // Requests that waited in the admission queue
+  std::atomic_uint64_t queued;
+  // Hedged child calls sent, and how many of them answered first
+  std::atomic_uint64_t hedged;
+  std::atomic_uint64_t hedge_wins;
+  // Estimated time spent in HINDSIGHT and OPENTELEMETRY blocks, see
+  // TracerTimer
+  std::atomic_uint64_t tracing_ns;
+  char pad_after_[64];
+};
+
 /* A simple async gRPC server that can run multiple threads. */
 class ServerImpl final {
  public:
   ServerImpl(ServiceConfig config, std::map<std::string, AddressInfo> addresses,
-             bool nocompute, std::map<int, float> triggers, int instance_id, int max_outstanding_requests);
+             bool nocompute, std::map<int, float> triggers, int instance_id, int max_outstanding_requests,
+             int compute_threads, bool batch_children, int channels_per_client,
+             int channel_selection, uint64_t seed, bool deterministic_fanout,
+             int limiter_mode, int cq_threads, int accept_depth,
+             int busy_poll_us, std::vector<int> cpus, bool sharded,
+             int replica_selection, int child_limit, int child_queue,
+             int admission_queue, int priority_scheduling,
+             int gemm_batch, int gemm_batch_delay_us, int perf_sample);
   ~ServerImpl();
 
   /* Runs the specified number of handler threads */
   void Run(int nthreads, bool debug);
   void PrintThread();
 
+  /* Serves the Stats RPC from its own completion queue, so that merging the
+  handlers' stats never holds up a handler */
+  void StatsThread();
+
   /* Initiates shutdown of the RPC server and awaits handlers */
   void Shutdown();
 
   /* Waits for all handlers to complete */
   void Join();
 
-  /* Thread-safe access to RPC clients*/
-  ChildClient* GetClient(std::string address);
+  /* Thread-safe access to RPC clients.  Handlers in sharded mode each pass
+  their own shard, and get clients of their own. */
+  ChildClient* GetClient(std::string address, int shard = -1);
 
  public:
   HindsightGRPC::AsyncService service_;
@@ -101,14 +164,93 @@ class ServerImpl final {
   // instance id
   const int instance_id;
 
-  // Admission control -- max requests per handler
+  // Admission control -- max requests per handler, and whether handlers
+  // adapt their limit below that to request latency
   const int max_outstanding_requests;
+  const int limiter_mode;
 
-  std::atomic_uint64_t awaiting;
-  std::atomic_uint64_t processing;
-  std::atomic_uint64_t awaitingchildren;
-  std::atomic_uint64_t finishing;
-  std::atomic_uint64_t completed;
+  // Requests over the limit that each handler queues rather than rejects,
+  // and how the admission queue and compute pool order requests by priority
+  const int admission_queue;
+  const PriorityScheduling priority_scheduling;
+
+  // Threads polling each handler's completion queue, and how many incoming
+  // RPCs each handler has posted RequestExec calls for
+  const int cq_threads;
+  const int accept_depth;
+
+  // Handler threads spin on their completion queue for up to busy_poll_us
+  // microseconds without an event before blocking; 0 always blocks, and
+  // negative never does
+  const int busy_poll_us;
+
+  // CPUs to pin the handler threads to, in order; empty if unpinned
+  const std::vector<int> cpus;
+  int HandlerCpu(int handler, int thread);
+
+  // The service's APIs, compiled at startup
+  RoutingTable routes;
+
+  // Each handler has its own routing table, clients and connections, and
+  // shares no mutable state with other handlers
+  const bool sharded;
+
+  // Seeds the handlers' random number generators
+  const uint64_t seed;
+
+  // Fan-out decisions are derived from each request's fanout_key rather than
+  // the handler's generator, so that a trace makes the same decisions on
+  // every run
+  const bool deterministic_fanout;
+
+  // Offloads API computation from the handler threads; null if computation
+  // runs inline on the handlers
+  const int compute_threads;
+  std::unique_ptr<ComputePool> compute_pool;
+
+  // The threads that run API computation: the compute pool's if there is
+  // one, otherwise all the handler threads
+  int work_threads;
+
+  // Batches the computation of requests for the same MatrixConfig, if
+  // gemm_batch is more than 1; null otherwise, and in sharded mode, where
+  // each handler has its own
+  const int gemm_batch;
+  const int gemm_batch_delay_us;
+  std::unique_ptr<GemmBatcher> gemm_batcher;
+
+  // One in perf_sample requests is measured with hardware counters, or
+  // none if 0; perf_threads counts the handler threads that could open them
+  const int perf_sample;
+  std::atomic_int perf_threads;
+
+  // Child calls to the same server are sent as one ExecBatch RPC
+  const bool batch_children;
+
+  // Outgoing connections per child server, and how calls pick one
+  const int channels_per_client;
+  const int channel_selection;
+
+  // How outcalls pick one of several instances of a service
+  const ReplicaSelection replica_selection;
+
+  // Outstanding calls allowed to each child server, 0 for no limit, and
+  // how many more may wait for one to complete
+  const int child_limit;
+  const int child_queue;
+
+  // Sums a counter over the handlers
+  uint64_t Total(std::atomic_uint64_t HandlerCounters::* counter);
+
+  // Merges the handlers' latency histograms of a stage of an API's requests
+  HistogramSnapshot Latency(int api_id, int stage);
+
+  // Sums the handlers' hardware counters of an API's sampled requests into
+  // totals, by category, and returns the number of requests
+  uint64_t PerfTotal(int api_id, PerfSample* totals);
+
+  // Fills in a reply to the Stats RPC
+  void GetStats(StatsReply* reply);
 
  private:
   // Clients to other RPC servers
@@ -123,29 +265,92 @@ class ServerImpl final {
 
   // gRPC bits
   std::vector<std::unique_ptr<ServerCompletionQueue>> cqs;
+  std::unique_ptr<ServerCompletionQueue> stats_cq;
   std::unique_ptr<Server> server_;
 
 };
 
-/* A handler thread of the server */
+/* State private to one of the threads polling a handler's completion queue.
+Requests and child calls may be resumed by any of their handler's threads,
+so the per-thread state they use is found via current() rather than through
+the handler. */
+class HandlerThread {
+ public:
+  HandlerThread(ServiceConfig config, uint64_t seed, int work_threads, int max_batch);
+  ~HandlerThread();
+
+  /* The calling thread's state; only valid on a handler's polling threads */
+  static HandlerThread& current() { return *current_; }
+  void MakeCurrent() { current_ = this; }
+
+  // Work engines by name, reused across requests
+  WorkEngines engines;
+
+  // Used for fan-out and trigger decisions
+  Xoshiro256 rng;
+
+  // Used only to pick requests for --perf_sample, so that sampling leaves
+  // the fan-out and trigger decisions of a seed unchanged
+  Xoshiro256 perf_rng;
+
+  // Requests, child calls and their batches are recycled rather than freed.
+  // They return to the pool of whichever thread finishes them.
+  ObjectPool<Request> request_pool;
+  ObjectPool<ChildCall> childcall_pool;
+  ObjectPool<BatchRequest> batch_pool;
+  ObjectPool<ChildBatchCall> childbatch_pool;
+
+  // The thread's hardware counters, if requests are sampled for them
+  PerfCounters perf;
+
+ private:
+  static thread_local HandlerThread* current_;
+};
+
+/* A handler of the server: a completion queue, polled by one or more
+threads */
 class ServerHandler {
  public:
   ServerHandler(ServerImpl* server, int handlerid, ServerCompletionQueue* cq, std::string local_address, ServiceConfig config) :
     server_(server), handlerid_(handlerid), cq_(cq), request_id_seed(0),
-    clients(), local_address(local_address), config(config), outstanding_requests(0), admitting_requests(0), draining(false) {
+    local_address(local_address), config(config), routes(&server->routes),
+    limiter((ConcurrencyLimiter::Mode) server->limiter_mode, server->max_outstanding_requests),
+    outstanding_requests(0), admitting_requests(0), waiting(server->priority_scheduling) {
       tracer_ = opentelemetry::trace::Provider::GetTracerProvider()->GetTracer("hindsight");
       propagator_ = opentelemetry::context::propagation::GlobalTextMapPropagator::GetGlobalPropagator();
+      gemm_batcher = server->gemm_batcher.get();
+
+      // Each thread creates its own state once it is running, and pinned
+      threads_.resize(server->cq_threads);
+      thread_clocks.resize(server->cq_threads, CLOCK_THREAD_CPUTIME_ID);
+
+      // API ids start at 1
+      for (size_t i = 0; i <= config.get_apis().size(); i++) {
+        latency.emplace_back(new StageHistograms());
+        perf.emplace_back(new PerfTotals());
+      }
     }
-  ~ServerHandler() {}
+  ~ServerHandler();
 
-  void Run();
+  /* Polls the completion queue; run by each of the handler's threads */
+  void Run(int thread);
   void PrepareNextRequest();
-  ChildClient* GetClient(std::string address);
+  bool BusyPoll(void** tag, bool* ok);
+
+  // Admits a request if it is under the limit and, with an admission queue,
+  // no request is queued.  Otherwise queues it, maybe displacing a less
+  // important request, or rejects it.
+  bool Admit(Request* request);
+
+  // Called as admitted requests finish, with the time they spent on this
+  // server; updates the limit, then admits queued requests while under it
+  void RequestFinished(uint64_t latency_ns);
+  void AdmitWaiting();
 
  private:
-  int request_id_seed;
-  std::map<std::string, ChildClient*> clients;
+  std::atomic_int request_id_seed;
   ServiceConfig config;
+  std::vector<std::unique_ptr<HandlerThread>> threads_;
 
  public:
   ServerImpl* server_;
@@ -159,27 +364,126 @@ class ServerHandler {
   // Hindsight stuff
   std::string local_address;
 
-  // Admission control
-  int outstanding_requests;
-  int admitting_requests;
-  bool draining;
+  // The server's routing table, or in sharded mode the handler's own
+  RoutingTable* routes;
+  RoutingTable shard_routes;
+
+  // The server's GEMM batcher, or in sharded mode the handler's own, which
+  // it deletes; null if computation isn't batched
+  GemmBatcher* gemm_batcher;
+
+  HandlerCounters counters;
+
+  // Latencies of the stages of requests, indexed by API::id
+  std::vector<std::unique_ptr<StageHistograms>> latency;
+
+  // Hardware counters of sampled requests, indexed by API::id
+  std::vector<std::unique_ptr<PerfTotals>> perf;
+
+  // The CPU-time clocks of the handler's threads
+  std::vector<clockid_t> thread_clocks;
+
+  // Admission control.  Requests are always accepted from gRPC, but those
+  // beyond the limiter's limit are rejected with RESOURCE_EXHAUSTED
+  std::mutex limiter_mutex;
+  ConcurrencyLimiter limiter;
+  std::atomic_int outstanding_requests;
+  std::atomic_int admitting_requests;
+
+  // Requests over the limit waiting to be admitted, by priority
+  std::mutex waiting_mutex;
+  PriorityQueue<Request*> waiting;
 };
 
-class Request;
-class ChildCall;
+/* One connection of a ChildClient */
+class ClientChannel {
+ public:
+  ClientChannel(std::string address, int index);
 
-/* A client to another gRPC server */
+  std::shared_ptr<Channel> channel;
+  std::unique_ptr<HindsightGRPC::Stub> stub;
+
+  // Calls sent on this channel that haven't completed yet
+  std::atomic_int outstanding;
+};
+
+/* A client to another gRPC server.  Shared by all handlers.
+
+The client has one or more channels, each with its own connection, so that
+traffic to a busy server isn't limited by a single HTTP/2 connection.
+
+With a limit, the client is a bulkhead: at most limit calls are sent at
+once, up to queue_limit more wait in FIFO order for one of those to
+complete, and the rest fail straight away with RESOURCE_EXHAUSTED.  A slow
+server then ties up a bounded number of calls rather than all of them.
+Batched calls are not limited. */
 class ChildClient {
  public:
-  explicit ChildClient(std::string address);
+  // How calls pick a channel
+  enum ChannelSelection { ROUND_ROBIN, LEAST_LOADED };
+
+  ChildClient(std::string address, int nchannels, ChannelSelection selection,
+              int limit = 0, int queue_limit = 0);
   ~ChildClient();
 
-  ChildCall* Call(Request* parent, Outcall* outcall, int id);
+  ChildCall* Call(Request* parent, Outcall* outcall, int id, uint64_t fanout_key,
+                  ChildBatchCall* batch = nullptr);
+
+  // Called when a call that was admitted by the bulkhead completes; hands
+  // its slot to the next waiting call, if any
+  void CallFinished();
+
+  // Rejects the calls waiting in the bulkhead, and any calls that would wait
+  // from now on, so that their requests can finish
+  void Shutdown();
+
+  // Picks a channel for a call and counts the call as outstanding on it;
+  // the caller must decrement the channel's outstanding count on completion
+  ClientChannel* PickChannel();
+
+  // Folds a completed call's latency into latency_ewma and recent_latency
+  void RecordLatency(uint64_t latency_ns);
+
+  // The given percentile of recent call latency in nanoseconds, or 0 if
+  // there have been too few calls yet
+  uint64_t LatencyPercentile(double percentile);
 
  public:
   std::string address;
-  std::shared_ptr<Channel> channel;
-  std::unique_ptr<HindsightGRPC::Stub> stub;
+  std::vector<std::unique_ptr<ClientChannel>> channels;
+  const ChannelSelection selection;
+  std::atomic_uint64_t next_channel;
+
+  // Whether the server understands binary trace context ids; shared by all
+  // handlers, and set by the first reply that says so
+  std::atomic_bool binary_context;
+
+  // Load on the server, for replica selection: calls that haven't completed
+  // yet, and a moving average of call latency in nanoseconds (0 until the
+  // first call completes).  Every handler writes these, so they are padded
+  // away from the fields that are only read.
+  char pad_before_[64];
+  std::atomic_int outstanding;
+  std::atomic_uint64_t latency_ewma;
+  char pad_after_[64];
+
+  // The latencies of the last calls, oldest overwritten first, for hedging
+  static const int latency_samples = 64;
+  std::atomic_uint64_t recent_latency[latency_samples];
+  std::atomic_uint64_t latency_count;
+
+  // The bulkhead: the limits, the calls sent, the calls waiting and whether
+  // the client has shut down, guarded by bulkhead_mutex; and how many calls
+  // have queued, for how long in total, and how many were rejected
+  const int limit;
+  const int queue_limit;
+  std::mutex bulkhead_mutex;
+  int sending;
+  std::deque<ChildCall*> waiting;
+  bool shut_down;
+  std::atomic_uint64_t queued;
+  std::atomic_uint64_t queued_ns;
+  std::atomic_uint64_t rejected;
 };
 
 /* gRPC's completion queue uses void* pointers for any events.
@@ -191,16 +495,53 @@ class Callback {
   virtual ~Callback(){}
 };
 
-// A request to this server
-class Request : public Callback {
+// A request to this server.  Requests are recycled through the handler
+// threads' request_pools: Start begins serving a new RPC, and Recycle resets
+// the request and returns it to a pool once the RPC is done.
+//
+// Only one of a request's own events is ever outstanding on the CQ, but its
+// children can complete concurrently on different handler threads.
+// children_mutex_ serializes their access to the request's trace state, and
+// outstanding_children holds an extra count while the children are being
+// started, so that the request can't complete underneath EndProcess.  The
+// losing attempt of a hedged child call may still complete after the
+// request, so Complete and FINISH take children_mutex_ too.
+class Request : public Callback, public ComputeTask {
  public:
-  Request(ServerHandler* handler, int requestid);
+  explicit Request(ServerHandler* handler);
   ~Request();
 
+  void Start(int requestid);
+  void StartBatched(BatchRequest* batch, int index);
+  void Recycle();
+
   void Proceed(bool ok);
-  void InvokeChildren(std::vector<Outcall*> calls, uint64_t span_id);
+  void Compute(WorkEngines& engines);
+  void EndProcess();
+  void InvokeChildren(uint64_t span_id);
+  void InvokeChildrenBatched(uint64_t span_id);
+  uint64_t ChildFanoutKey(int index);
   void ChildResponseReceived(ChildCall* call, bool ok);
-  void Complete();
+  void HedgeChild(ChildCall* call, bool ok);
+  void ChildDone();
+  void Complete(const Status& status = Status::OK);
+  void Reject();
+  // Records the latencies of the request's stages once it has finished
+  void RecordStages();
+  // Where to add the request's hardware counters, once its API is known
+  PerfTotals* PerfTotalsFor();
+
+  // Called when gRPC is done with the RPC, including if it was cancelled
+  void Done();
+  // Marks the request cancelled and cancels its outstanding child calls;
+  // also called by its batch if the caller cancels the ExecBatch
+  void Cancel();
+  // Drops one of the events the request is waiting for, recycling it after
+  // the last
+  void Release();
+  // Whether the request was cancelled or is past its deadline, in which case
+  // its computation and children are skipped
+  bool Abandoned();
 
   SpanContext extractContextFromRPC();
 
@@ -209,54 +550,155 @@ class Request : public Callback {
   ServerHandler* handler_;
   HindsightGRPC::AsyncService* service_;
 
-  // gRPC request and response
-  ExecRequest request_;
-  ExecReply reply_;
-
-  // gRPC pieces about the request
-  ServerContext ctx_;
-  ServerAsyncResponseWriter<ExecReply> responder_;
+  // gRPC request and response.  These, and the messages of the request's
+  // child calls, are allocated on arena_ and released together in Recycle.
+  char arena_block_[4096];
+  google::protobuf::Arena arena_;
+  ExecRequest* request_;
+  ExecReply* reply_;
+
+  // gRPC pieces about the request.  A ServerContext can't be reused across
+  // RPCs, so these are rebuilt in place in Recycle rather than reallocated.
+  typedef ServerAsyncResponseWriter<ExecReply> Responder;
+  ServerContext* ctx_;
+  Responder* responder_;
+  std::aligned_storage<sizeof(ServerContext), alignof(ServerContext)>::type ctx_storage_;
+  std::aligned_storage<sizeof(Responder), alignof(Responder)>::type responder_storage_;
 
   // OpenTelemetry
   nostd::shared_ptr<Span> request_span; // The span representing the end-to-end RPC request
+  nostd::shared_ptr<Span> process_span; // The span representing PROCESS, including computation
 
   // Hindsight (in non-OpenTelemetry mode)
   std::shared_ptr<HindsightTraceState> hs_; // the trace state
   uint64_t start_time; // used for latency trigger
 
-  // Implemented as a state machine similar to the gRPC async example
-  enum CallStatus { CREATE, PROCESS, AWAITCHILDREN, FINISH };
+  // Implemented as a state machine similar to the gRPC async example.
+  // COMPUTE is only used when computation is offloaded to the compute pool.
+  // QUEUED requests are waiting for admission, and resume PROCESS once
+  // admitted.  REJECTED requests skip straight from PROCESS to finishing.
+  enum CallStatus { CREATE, PROCESS, QUEUED, COMPUTE, AWAITCHILDREN, FINISH, REJECTED };
   CallStatus status_;
 
-  int outstanding_children;
+  // The API being executed, the children picked for it, and how long its
+  // computation took
+  const Route* route_;
+  std::vector<const RouteTarget*> targets_;
+  std::vector<const RouteCall*> target_calls_;
+  int64_t exec_duration;
+
+  // Used by the compute pool, and by batched requests, to resume the request
+  // on the handler's CQ
+  grpc::Alarm alarm_;
+
+  // Set if this request is one of the calls of an ExecBatch RPC, in which
+  // case ctx_ and responder_ are unused and the reply goes to the batch
+  BatchRequest* batch_;
+  int batch_index_;
+
+  std::mutex children_mutex_;
+  std::atomic_int outstanding_children;
+
+  // The child calls still outstanding, so that they can be cancelled;
+  // entries are cleared as responses arrive.  Guarded by children_mutex_.
+  std::vector<ChildCall*> children_;
+
+  // The caller's deadline, or the API's timeout if that is sooner; passed on
+  // to child calls.  time_point::max() if there is none.
+  std::chrono::system_clock::time_point deadline_;
+  std::atomic_bool cancelled_;
+
+  // When the request joined the admission queue, if it did
+  uint64_t queued_at_;
+
+  // When the request reached PROCESS, finished computing, and finished
+  // waiting for its children; with start_time, these time its stages
+  uint64_t arrived_at_;
+  uint64_t computed_at_;
+  uint64_t completed_at_;
+
+  // If the request was computed in a GemmBatcher batch, the batch's size
+  // and how long the request waited for it to run
+  int gemm_batch_size_;
+  uint64_t gemm_batch_wait_;
+
+  // Whether the request's stages are measured with hardware counters, see
+  // --perf_sample
+  bool perf_sampled_;
+
+  // Notified when gRPC is done with the RPC.  Both this and FINISH must
+  // arrive before the request can be recycled, as must pending hedge timers
+  // and the losing attempts of hedged child calls; refs_ counts them down.
+  class DoneCallback : public Callback {
+   public:
+    explicit DoneCallback(Request* request) : request_(request) {}
+    void Proceed(bool ok) { request_->Done(); }
+   private:
+    Request* request_;
+  };
+  DoneCallback done_callback_;
+  std::atomic_int refs_;
 
 };
 
-// A call to another RPC server
+// A call to another RPC server.  Child calls are recycled through the
+// handler threads' childcall_pools, like Requests.
 class ChildCall : public Callback {
  public:
-  ChildCall(ChildClient* child, Request* parent, Outcall* outcall, int id);
+  ChildCall();
   ~ChildCall();
 
+  void Start(ChildClient* child, Request* parent, Outcall* outcall, int id, ChildBatchCall* batch);
+  void Recycle();
+
   // Initiates the call
   void SendCall();
 
   // The callback invoked by gRPC when a response is received
   void Proceed(bool ok);
 
+  // Cancels the call, or the batch it was sent in
+  void Cancel();
+
+  // Sends a duplicate of the call to another of route_call's targets if it
+  // hasn't been answered after delay_ns
+  void ArmHedge(const RouteCall* route_call, const RouteTarget* target, uint64_t delay_ns);
+
+  // Drops one of the events the call is waiting for, recycling it after the
+  // last
+  void Release();
+
+  // Sends a call that waited in its client's bulkhead
+  void SendQueued();
+
+  // Rejects a call that waited in its client's bulkhead
+  void RejectQueued();
+
+  // Fails the call with RESOURCE_EXHAUSTED without sending it
+  void Reject();
+
  private:
   // Server pieces
   ChildClient* child_;
   Request* parent_;
 
-  // gRPC pieces
-  ClientContext context;
+  // Set if the call is sent as part of a batch rather than on its own
+  ChildBatchCall* batch_;
+
+  // The channel the call was sent on, unless it was batched
+  ClientChannel* channel_;
+
+  // gRPC pieces.  Like ServerContext, a ClientContext is rebuilt in place.
+  ClientContext* context;
+  std::aligned_storage<sizeof(ClientContext), alignof(ClientContext)>::type context_storage_;
   std::unique_ptr<ClientAsyncResponseReader<ExecReply>> response_reader;
 
  public:
-  // gRPC reply
+  // gRPC request and reply, allocated on the parent request's arena.  For a
+  // batched call the request is one of the batch's calls.
+  ExecRequest* request;
   Status status;
-  ExecReply reply;
+  ExecReply* reply;
 
   // Topology config
   Outcall* outcall_;
@@ -266,8 +708,159 @@ class ChildCall : public Callback {
 
   // Hindsight
   int id_;
+
+  // When the call started, for the client's latency average
+  uint64_t start_time_;
+
+  // Hedging.  The call's route and target, to pick another target from;
+  // the other attempt of a hedged call, if both are outstanding; whether
+  // this is the duplicate; and whether this attempt has answered, or lost
+  // to the other.  Guarded by the parent's children_mutex_.
+  const RouteCall* route_call_;
+  const RouteTarget* target_;
+  ChildCall* sibling_;
+  bool hedge_;
+  bool answered_;
+  bool lost_;
+
+  class HedgeCallback : public Callback {
+   public:
+    explicit HedgeCallback(ChildCall* call) : call_(call) {}
+    void Proceed(bool ok) { call_->parent_->HedgeChild(call_, ok); }
+   private:
+    ChildCall* call_;
+  };
+  grpc::Alarm hedge_alarm_;
+  HedgeCallback hedge_callback_;
+  bool hedge_armed_;
+
+  // The response, and the hedge timer if it is armed
+  std::atomic_int refs_;
+
+  // Whether the call holds one of its client's bulkhead slots, and when it
+  // started waiting for one.  A rejected call completes through alarm_.
+  bool admitted_;
+  uint64_t queued_at_;
+  grpc::Alarm alarm_;
 };
 
+// An incoming ExecBatch RPC.  Each of its calls is served by a Request of
+// its own, and the batch replies once all of them have finished.  Batches are
+// recycled through the handler threads' batch_pools, like requests.
+class BatchRequest : public Callback {
+ public:
+  explicit BatchRequest(ServerHandler* handler);
+  ~BatchRequest();
+
+  void Start();
+  void Recycle();
+
+  void Proceed(bool ok);
+  // Records the status a call finished with; calls may set theirs
+  // concurrently
+  void SetStatus(int index, const Status& status);
+  void CallFinished(Request* call, bool ok);
+  void CallDone();
+
+  // Called when gRPC is done with the RPC; if the caller cancelled it,
+  // cancels the calls still running
+  void Done();
+  // Drops one of the events the batch is waiting for, recycling it after
+  // the last
+  void Release();
+
+ public:
+  ServerHandler* handler_;
+
+  // gRPC pieces, rebuilt in place in Recycle like a Request's
+  typedef ServerAsyncResponseWriter<ExecBatchReply> Responder;
+  ExecBatchRequest request_;
+  ExecBatchReply reply_;
+  ServerContext* ctx_;
+  Responder* responder_;
+  std::aligned_storage<sizeof(ServerContext), alignof(ServerContext)>::type ctx_storage_;
+  std::aligned_storage<sizeof(Responder), alignof(Responder)>::type responder_storage_;
+
+  enum CallStatus { CREATE, PROCESS, FINISH };
+  CallStatus status_;
+
+  // The calls may finish on different handler threads
+  std::atomic_int outstanding_calls;
+
+  // The calls still running, so that they can be cancelled; entries are
+  // cleared as calls finish.  Guarded by calls_mutex_.
+  std::mutex calls_mutex_;
+  std::vector<Request*> calls_;
+
+  // Notified when gRPC is done with the RPC.  Both this and FINISH must
+  // arrive before the batch can be recycled; refs_ counts them down.
+  class DoneCallback : public Callback {
+   public:
+    explicit DoneCallback(BatchRequest* batch) : batch_(batch) {}
+    void Proceed(bool ok) { batch_->Done(); }
+   private:
+    BatchRequest* batch_;
+  };
+  DoneCallback done_callback_;
+  std::atomic_int refs_;
+};
+
+// A call to the Stats RPC.  The server's stats thread accepts one at a time.
+class StatsCall : public Callback {
+ public:
+  StatsCall(ServerImpl* server, ServerCompletionQueue* cq);
+
+  void Proceed(bool ok);
+
+ private:
+  ServerImpl* server_;
+  ServerCompletionQueue* cq_;
+
+  ServerContext ctx_;
+  StatsRequest request_;
+  StatsReply reply_;
+  ServerAsyncResponseWriter<StatsReply> responder_;
+
+  enum CallStatus { CREATE, PROCESS, FINISH };
+  CallStatus status_;
+};
+
+// Several child calls to the same RPC server, sent as one ExecBatch RPC.
+// Each call still has its own ChildCall, with its own spans, which receives
+// its reply and status from the batch.  Recycled through the handler
+// threads' childbatch_pools.
+class ChildBatchCall : public Callback {
+ public:
+  ChildBatchCall();
+  ~ChildBatchCall();
+
+  void Start(ChildClient* child, Request* parent);
+  void Recycle();
+
+  // Adds a call to the batch and returns the request to fill in for it
+  ExecRequest* AddCall(ChildCall* call);
+
+  // Sends the batch once all of its calls have been added
+  void SendCall();
+
+  // The callback invoked by gRPC when the batch reply is received
+  void Proceed(bool ok);
+
+ public:
+  ChildClient* child_;
+  Request* parent_;
+  ClientChannel* channel_;
+
+  // gRPC pieces; the messages are on the parent request's arena
+  ClientContext* context;
+  std::aligned_storage<sizeof(ClientContext), alignof(ClientContext)>::type context_storage_;
+  std::unique_ptr<ClientAsyncResponseReader<ExecBatchReply>> response_reader;
+  ExecBatchRequest* request;
+  ExecBatchReply* reply;
+  Status status;
+
+  std::vector<ChildCall*> calls;
+};
 
 }  // namespace hindsightgrpc
 
@@ -10,6 +10,7 @@
 #include <cmath>
 
 #include "topology.h"
+#include "calibration.h"
 
 #include <json.hpp>
 
@@ -23,11 +24,49 @@ namespace hindsightgrpc {
         return j;
     }
 
+    std::map<std::string, std::map<std::string, int>> get_api_ids(json& global_config) {
+        std::map<std::string, std::map<std::string, int>> ids;
+        for (auto &it : global_config["services"]) {
+            // Ids follow name order, the same order as ServiceConfig's map
+            std::map<std::string, int>& service_ids = ids[it["name"]];
+            for (auto &ait : it["apis"]) {
+                service_ids[ait["name"]] = 0;
+            }
+            int id = 1;
+            for (auto &p : service_ids) {
+                p.second = id++;
+            }
+        }
+        return ids;
+    }
+
+    std::map<std::string, std::map<std::string, int>> get_api_priorities(json& global_config) {
+        std::map<std::string, std::map<std::string, int>> priorities;
+        for (auto &it : global_config["services"]) {
+            std::map<std::string, int>& service_priorities = priorities[it["name"]];
+            for (auto &ait : it["apis"]) {
+                service_priorities[ait["name"]] = ait.value("priority", 0);
+            }
+        }
+        return priorities;
+    }
+
+    // An API's id or priority, or 0 if the service or API is unknown
+    static int find_api(std::map<std::string, std::map<std::string, int>>& values,
+                        const std::string& service_name, const std::string& api_name) {
+        auto service = values.find(service_name);
+        if (service == values.end()) return 0;
+        auto api = service->second.find(api_name);
+        return api == service->second.end() ? 0 : api->second;
+    }
+
     ServiceConfig get_service_config(
         json global_config,
         std::string service_name,
         std::map<std::string, AddressInfo>& addresses) {
         std::map<std::string, API> apis;
+        std::map<std::string, std::map<std::string, int>> api_ids = get_api_ids(global_config);
+        std::map<std::string, std::map<std::string, int>> api_priorities = get_api_priorities(global_config);
         bool found = false;
         for (auto it : global_config["services"]) {
             if (it["name"] == service_name) {
@@ -38,12 +77,28 @@ namespace hindsightgrpc {
                     Outcall child =
                         Outcall(chit["service"], chit["api"], chit["probability"],
                                 addresses[service_name].connection_addresses,
-                                addresses[service_name].breadcrumbs);
+                                addresses[service_name].breadcrumbs,
+                                addresses[service_name].weights);
+                    child.api_id = find_api(api_ids, chit["service"], chit["api"]);
+                    child.priority = find_api(api_priorities, chit["service"], chit["api"]);
+                    child.hedge_delay = chit.value("hedge_ms", 0.0);
+                    child.hedge_percentile = chit.value("hedge_percentile", 0.0);
+                    for (auto &subcall : child.subcalls) {
+                        subcall.api_id = child.api_id;
+                        subcall.priority = child.priority;
+                    }
                     children.push_back(child);
                 }
-                API api = API(ait["name"], ait["exec"], children);
+                API api = API(ait["name"], ait["exec"], children,
+                              ait.value("engine", std::string("matrix")),
+                              ait.value("timeout", 0.0),
+                              ait.value("priority", 0));
                 apis[ait["name"]] = api;
             }
+            int id = 1;
+            for (auto &p : apis) {
+                p.second.id = id++;
+            }
             // We have found the service!
             found = true;
             break;
@@ -73,9 +128,7 @@ namespace hindsightgrpc {
         return addresses;
     }
 
-    void ServiceConfig::generate_matrix_configs() {
-        // TODO: Possibly convert this into an option.
-        std::string fname("../config/matrix_benchmarks.csv");
+    bool ServiceConfig::generate_matrix_configs(std::string fname) {
         std::fstream fin(fname, std::ios::in);
         std::map<double, MatrixConfig> loaded_configs;
         if (fin.is_open()) {
@@ -119,8 +172,47 @@ namespace hindsightgrpc {
                 }
                 api_matrix_configs[it->first] = config;
             }
+            return true;
+        }
+        return false;
+    }
+
+    void ServiceConfig::calibrate_matrix_configs(const WorkModel& model, MatrixWorkspace& workspace, double tolerance) {
+        for (auto it = apis.begin(); it != apis.end(); ++it) {
+            double target = it->second.exec;
+            if (it->second.engine != "matrix") {
+                // Other engines run for exec directly
+                continue;
+            }
+            if (target <= 0) {
+                api_matrix_configs[it->first] = MatrixConfig(0, 0, 0);
+                continue;
+            }
+
+            // The model is only approximate, so measure the solved shape and
+            // re-solve against a corrected target if it misses
+            double goal = target;
+            MatrixConfig best;
+            double best_error = std::numeric_limits<double>::max();
+            double best_measured = 0;
+            for (int attempt = 0; attempt < 3; attempt++) {
+                MatrixConfig config = model.Solve(goal, tolerance);
+                workspace.Reserve(config);
+                double measured = measure_matrix_multiply(workspace, config);
+                double error = std::abs(measured - target) / target;
+                if (error < best_error) {
+                    best_error = error;
+                    best = config;
+                    best_measured = measured;
+                }
+                if (error <= tolerance) break;
+                goal *= target / measured;
+            }
+
+            std::cout << "Calibrated api " << it->first << " exec " << target
+                      << "ms to " << best << " measured " << best_measured << "ms" << std::endl;
+            api_matrix_configs[it->first] = best;
         }
-        // TODO: Handle the case when the file was not opened.
     }
 
 }  // namespace hindsightgrpc
@@ -17,6 +17,8 @@
 using json = nlohmann::json;
 
 namespace hindsightgrpc {
+  class WorkModel;
+
   struct AddressInfo {
     public:
       AddressInfo(std::string name, std::string port, std::string deploy_addr, std::string hostname, std::string agent_port) 
@@ -26,6 +28,7 @@ namespace hindsightgrpc {
         agent_ports.push_back(agent_port);
         connection_addresses.push_back(hostname + ":" + port);
         breadcrumbs.push_back(hostname + ":" + agent_port);
+        weights.push_back(1);
         num_instances = 1;
       }
       AddressInfo(std::string name, std::string deploy_addr, std::vector<json> instances)
@@ -39,6 +42,7 @@ namespace hindsightgrpc {
           agent_ports.push_back(agent_port);
           connection_addresses.push_back(hostname + ":" + port);
           breadcrumbs.push_back(hostname + ":" + agent_port);
+          weights.push_back(i.value("weight", 1));
         }
         num_instances = instances.size();
       }
@@ -55,6 +59,8 @@ namespace hindsightgrpc {
       std::vector<std::string> agent_ports;
       std::vector<std::string> connection_addresses;
       std::vector<std::string> breadcrumbs;
+      // relative share of calls for weighted replica selection; default 1
+      std::vector<int> weights;
       // std::string get_connection_address() { return hostname + ":" + port; }
       // std::string get_breadcrumb() { return hostname + ":" + agent_port; }
       int num_instances;
@@ -65,25 +71,35 @@ namespace hindsightgrpc {
     public:
       Outcall(std::string service_name, std::string api_name, int probability,
               std::vector<std::string> connection_addresses,
-              std::vector<std::string> breadcrumbs)
+              std::vector<std::string> breadcrumbs,
+              std::vector<int> weights = std::vector<int>())
           : service_name(service_name),
             api_name(api_name),
-            probability(probability) {
+            probability(probability),
+            api_id(0),
+            weight(1),
+            hedge_delay(0),
+            hedge_percentile(0),
+            priority(0) {
         unique_name = service_name + ":" + api_name;
-        int num_instances = connection_addresses.size();
+        size_t num_instances = connection_addresses.size();
         assert(num_instances == breadcrumbs.size());
         if (num_instances == 1) {
           server_addr = connection_addresses[0];
           breadcrumb = breadcrumbs[0];
         } else {
-          for (int i = 0; i < num_instances; i++) {
+          for (size_t i = 0; i < num_instances; i++) {
             subcalls.push_back(Outcall(service_name, api_name, probability,
                                       connection_addresses[i], breadcrumbs[i]));
+            if (i < weights.size()) {
+              subcalls.back().weight = weights[i];
+            }
           }
         }
       }
       Outcall(std::string service_name, std::string api_name, int probability, std::string server_addr, std::string breadcrumb) 
-      : service_name(service_name), api_name(api_name), probability(probability), server_addr(server_addr), breadcrumb(breadcrumb) {
+      : service_name(service_name), api_name(api_name), probability(probability), server_addr(server_addr), breadcrumb(breadcrumb), api_id(0), weight(1),
+        hedge_delay(0), hedge_percentile(0), priority(0) {
         unique_name = service_name + ":" + api_name;
       }
       friend std::ostream& operator<<(std::ostream& os, const Outcall& outcall) {
@@ -104,6 +120,18 @@ namespace hindsightgrpc {
       int probability;
       std::string server_addr;
       std::string breadcrumb;
+      // the id of api_name within service_name, or 0 if unknown; see API::id
+      int api_id;
+      // this instance's relative share of calls for weighted replica selection
+      int weight;
+      // for services with several instances: milliseconds to wait for a
+      // response before sending a duplicate call to another instance, or
+      // which percentile of the instance's recent latency to wait for
+      // instead; 0 for none
+      double hedge_delay;
+      double hedge_percentile;
+      // the priority of api_name within service_name; see API::priority
+      int priority;
       // revealed when picking a instance for the service
       std::vector<Outcall> subcalls;
   };
@@ -111,10 +139,13 @@ namespace hindsightgrpc {
   /* An API provided by the service */
   class API {
     public:
-      API(std::string name, double exec, std::vector<Outcall> children) : name(name), exec(exec), children(children) {}
-      API() {}
+      API(std::string name, double exec, std::vector<Outcall> children, std::string engine = "matrix",
+          double timeout = 0, int priority = 0)
+        : name(name), exec(exec), children(children), engine(engine), timeout(timeout),
+          priority(priority), id(0) {}
+      API() : engine("matrix"), timeout(0), priority(0), id(0) {}
       friend std::ostream& operator<<(std::ostream& os, const API& api) {
-        os << api.name << ": " << api.exec << "\n";
+        os << api.name << ": " << api.exec << " (" << api.engine << ")\n";
         for (auto child : api.children) {
             os << "\t\t" << child << "\n";
         }
@@ -125,6 +156,23 @@ namespace hindsightgrpc {
       
       std::string name;
       double exec;
+
+      // The work engine used for exec, see work_engine.h
+      std::string engine;
+
+      // Milliseconds a request may take, including its children, unless the
+      // caller's deadline is sooner; 0 for no limit
+      double timeout;
+
+      // How important the API's requests are, from 0 (the default) to 3.
+      // Callers send it in ExecRequest.priority, and under overload servers
+      // queue and shed less important requests first.
+      int priority;
+
+      // Dense id of the API within its service, starting at 1: the APIs are
+      // numbered in name order.  Callers that parse the same topology file
+      // agree on the ids, and can send them in ExecRequest.api_id.
+      int id;
   };
 
   /* A service config*/
@@ -148,13 +196,21 @@ namespace hindsightgrpc {
 
       MatrixConfig& get_matrix_config(std::string api_name) { return api_matrix_configs[api_name]; }
 
+      const std::map<std::string, MatrixConfig>& get_matrix_configs() { return api_matrix_configs; }
+
       void print_matrix_configs() {
         for (auto it = api_matrix_configs.begin(); it != api_matrix_configs.end(); ++it) {
           std::cout << "Config for api " << it->first << " is: (" << it->second.m_ << "," << it->second.n_ << "," << it->second.k_ << ")\n";
         }
       }
 
-      void generate_matrix_configs();
+      /* Picks the benchmarked shape closest to each API's exec value from a
+      matrix benchmarks CSV.  Returns false if the file can't be opened. */
+      bool generate_matrix_configs(std::string fname);
+
+      /* Solves for a shape that hits each API's exec value within tolerance
+      (a fraction) on this machine, verifying each shape by measuring it. */
+      void calibrate_matrix_configs(const WorkModel& model, MatrixWorkspace& workspace, double tolerance);
 
     private:
       std::string name;
@@ -163,6 +219,13 @@ namespace hindsightgrpc {
   };
 
   json parse_config(std::string fname);
+
+  /* The ids of every service's APIs (see API::id), by service name and then
+  API name */
+  std::map<std::string, std::map<std::string, int>> get_api_ids(json& global_config);
+  /* The priorities of every service's APIs (see API::priority), by service
+  name and then API name */
+  std::map<std::string, std::map<std::string, int>> get_api_priorities(json& global_config);
   ServiceConfig get_service_config(json global_config, std::string service_name, std::map<std::string, AddressInfo>& addresses);
   std::map<std::string, AddressInfo> get_address_map(json global_config);
 
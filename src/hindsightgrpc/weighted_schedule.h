@@ -0,0 +1,48 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_WEIGHTED_SCHEDULE_H_
+#define SRC_HINDSIGHTGRPC_WEIGHTED_SCHEDULE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace hindsightgrpc {
+
+/* One round of smooth weighted round robin over targets with the given
+weights: each step, every target earns its weight, and the target with the
+most credit is picked and pays the total.  Of weights 5,1,1 this gives
+0,0,1,0,2,0,0 rather than 0,0,0,0,0,1,2.
+
+Negative weights count as 0.  If all weights are 0, every target gets 1. */
+inline std::vector<int> weighted_schedule(std::vector<int> weights) {
+  int total = 0;
+  for (int &weight : weights) {
+    weight = std::max(weight, 0);
+    total += weight;
+  }
+  if (total == 0) {
+    std::fill(weights.begin(), weights.end(), 1);
+    total = weights.size();
+  }
+
+  std::vector<int> schedule;
+  std::vector<int> credit(weights.size(), 0);
+  for (int step = 0; step < total; step++) {
+    size_t best = 0;
+    for (size_t i = 0; i < weights.size(); i++) {
+      credit[i] += weights[i];
+      if (credit[i] > credit[best]) best = i;
+    }
+    credit[best] -= total;
+    schedule.push_back(best);
+  }
+  return schedule;
+}
+
+}  // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_WEIGHTED_SCHEDULE_H_
@@ -4,21 +4,313 @@
 
 #include "work.h"
 
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WORK_X86 1
+#include <immintrin.h>
+#endif
+
 namespace hindsightgrpc {
-    double matrix_multiply(const MatrixConfig& config) {
-        double M1[config.m_][config.n_], M2[config.n_][config.k_], M3[config.m_][config.k_];
+    // Block sizes for the tiled kernels.  A KC x NC panel of B (256KB) stays
+    // in L2 while MC x KC rows of A (64KB) are streamed through it.
+    static const int MC = 64;
+    static const int KC = 128;
+    static const int NC = 256;
+
+    /* The original i-j-k loop.  Kept as a reference implementation. */
+    static void gemm_naive(int m, int n, int k, const double* A,
+                           const double* B, double* C) {
+        for (int i = 0; i < m; ++i)
+            for (int j = 0; j < k; ++j) {
+                double sum = 0;
+                for (int p = 0; p < n; ++p) {
+                    sum += A[i * n + p] * B[p * k + j];
+                }
+                C[i * k + j] = sum;
+            }
+    }
+
+    /* Portable cache-blocked i-p-j loop; the inner loop is left to the
+    compiler to vectorize */
+    static void gemm_blocked(int m, int n, int k, const double* A,
+                             const double* B, double* C) {
+        std::memset(C, 0, sizeof(double) * m * k);
+        for (int jc = 0; jc < k; jc += NC) {
+            int nc = std::min(NC, k - jc);
+            for (int pc = 0; pc < n; pc += KC) {
+                int kc = std::min(KC, n - pc);
+                for (int ic = 0; ic < m; ic += MC) {
+                    int mc = std::min(MC, m - ic);
+                    for (int i = ic; i < ic + mc; ++i) {
+                        double* c = &C[i * k + jc];
+                        for (int p = pc; p < pc + kc; ++p) {
+                            double a = A[i * n + p];
+                            const double* b = &B[p * k + jc];
+                            for (int j = 0; j < nc; ++j) {
+                                c[j] += a * b[j];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /* Scalar fallback for the ragged edges of a tile that don't fill a
+    micro-kernel */
+    static inline void gemm_edge(int rows, int cols, int kc, int n, int k,
+                                 const double* A, const double* B, double* C) {
+        for (int i = 0; i < rows; ++i)
+            for (int p = 0; p < kc; ++p) {
+                double a = A[i * n + p];
+                for (int j = 0; j < cols; ++j) {
+                    C[i * k + j] += a * B[p * k + j];
+                }
+            }
+    }
 
-        for (int i = 0; i < config.m_; ++i)
-            for (int j = 0; j < config.k_; ++j)
-                for (int k = 0; k < config.n_; ++k) {
-                    M3[i][j] += M1[i][k] * M2[k][j];
+#ifdef WORK_X86
+    /* 4x8 register-blocked AVX2 micro-kernel: C[4][8] += A[4][kc] * B[kc][8] */
+    __attribute__((target("avx2,fma")))
+    static inline void micro_avx2(int kc, int n, int k, const double* A,
+                                  const double* B, double* C) {
+        __m256d c00 = _mm256_loadu_pd(&C[0 * k]), c01 = _mm256_loadu_pd(&C[0 * k + 4]);
+        __m256d c10 = _mm256_loadu_pd(&C[1 * k]), c11 = _mm256_loadu_pd(&C[1 * k + 4]);
+        __m256d c20 = _mm256_loadu_pd(&C[2 * k]), c21 = _mm256_loadu_pd(&C[2 * k + 4]);
+        __m256d c30 = _mm256_loadu_pd(&C[3 * k]), c31 = _mm256_loadu_pd(&C[3 * k + 4]);
+        for (int p = 0; p < kc; ++p) {
+            __m256d b0 = _mm256_loadu_pd(&B[p * k]);
+            __m256d b1 = _mm256_loadu_pd(&B[p * k + 4]);
+            __m256d a;
+            a = _mm256_broadcast_sd(&A[0 * n + p]);
+            c00 = _mm256_fmadd_pd(a, b0, c00); c01 = _mm256_fmadd_pd(a, b1, c01);
+            a = _mm256_broadcast_sd(&A[1 * n + p]);
+            c10 = _mm256_fmadd_pd(a, b0, c10); c11 = _mm256_fmadd_pd(a, b1, c11);
+            a = _mm256_broadcast_sd(&A[2 * n + p]);
+            c20 = _mm256_fmadd_pd(a, b0, c20); c21 = _mm256_fmadd_pd(a, b1, c21);
+            a = _mm256_broadcast_sd(&A[3 * n + p]);
+            c30 = _mm256_fmadd_pd(a, b0, c30); c31 = _mm256_fmadd_pd(a, b1, c31);
+        }
+        _mm256_storeu_pd(&C[0 * k], c00); _mm256_storeu_pd(&C[0 * k + 4], c01);
+        _mm256_storeu_pd(&C[1 * k], c10); _mm256_storeu_pd(&C[1 * k + 4], c11);
+        _mm256_storeu_pd(&C[2 * k], c20); _mm256_storeu_pd(&C[2 * k + 4], c21);
+        _mm256_storeu_pd(&C[3 * k], c30); _mm256_storeu_pd(&C[3 * k + 4], c31);
+    }
+
+    __attribute__((target("avx2,fma")))
+    static void gemm_avx2(int m, int n, int k, const double* A,
+                          const double* B, double* C) {
+        std::memset(C, 0, sizeof(double) * m * k);
+        for (int jc = 0; jc < k; jc += NC) {
+            int nc = std::min(NC, k - jc);
+            for (int pc = 0; pc < n; pc += KC) {
+                int kc = std::min(KC, n - pc);
+                for (int ic = 0; ic < m; ic += MC) {
+                    int mc = std::min(MC, m - ic);
+                    int j = 0;
+                    for (; j + 8 <= nc; j += 8) {
+                        int i = 0;
+                        for (; i + 4 <= mc; i += 4) {
+                            micro_avx2(kc, n, k, &A[(ic + i) * n + pc],
+                                       &B[pc * k + jc + j], &C[(ic + i) * k + jc + j]);
+                        }
+                        gemm_edge(mc - i, 8, kc, n, k, &A[(ic + i) * n + pc],
+                                  &B[pc * k + jc + j], &C[(ic + i) * k + jc + j]);
+                    }
+                    gemm_edge(mc, nc - j, kc, n, k, &A[ic * n + pc],
+                              &B[pc * k + jc + j], &C[ic * k + jc + j]);
+                }
+            }
+        }
+    }
+
+    /* 4x16 register-blocked AVX-512 micro-kernel: C[4][16] += A[4][kc] * B[kc][16] */
+    __attribute__((target("avx512f")))
+    static inline void micro_avx512(int kc, int n, int k, const double* A,
+                                    const double* B, double* C) {
+        __m512d c00 = _mm512_loadu_pd(&C[0 * k]), c01 = _mm512_loadu_pd(&C[0 * k + 8]);
+        __m512d c10 = _mm512_loadu_pd(&C[1 * k]), c11 = _mm512_loadu_pd(&C[1 * k + 8]);
+        __m512d c20 = _mm512_loadu_pd(&C[2 * k]), c21 = _mm512_loadu_pd(&C[2 * k + 8]);
+        __m512d c30 = _mm512_loadu_pd(&C[3 * k]), c31 = _mm512_loadu_pd(&C[3 * k + 8]);
+        for (int p = 0; p < kc; ++p) {
+            __m512d b0 = _mm512_loadu_pd(&B[p * k]);
+            __m512d b1 = _mm512_loadu_pd(&B[p * k + 8]);
+            __m512d a;
+            a = _mm512_set1_pd(A[0 * n + p]);
+            c00 = _mm512_fmadd_pd(a, b0, c00); c01 = _mm512_fmadd_pd(a, b1, c01);
+            a = _mm512_set1_pd(A[1 * n + p]);
+            c10 = _mm512_fmadd_pd(a, b0, c10); c11 = _mm512_fmadd_pd(a, b1, c11);
+            a = _mm512_set1_pd(A[2 * n + p]);
+            c20 = _mm512_fmadd_pd(a, b0, c20); c21 = _mm512_fmadd_pd(a, b1, c21);
+            a = _mm512_set1_pd(A[3 * n + p]);
+            c30 = _mm512_fmadd_pd(a, b0, c30); c31 = _mm512_fmadd_pd(a, b1, c31);
+        }
+        _mm512_storeu_pd(&C[0 * k], c00); _mm512_storeu_pd(&C[0 * k + 8], c01);
+        _mm512_storeu_pd(&C[1 * k], c10); _mm512_storeu_pd(&C[1 * k + 8], c11);
+        _mm512_storeu_pd(&C[2 * k], c20); _mm512_storeu_pd(&C[2 * k + 8], c21);
+        _mm512_storeu_pd(&C[3 * k], c30); _mm512_storeu_pd(&C[3 * k + 8], c31);
+    }
+
+    __attribute__((target("avx512f")))
+    static void gemm_avx512(int m, int n, int k, const double* A,
+                            const double* B, double* C) {
+        std::memset(C, 0, sizeof(double) * m * k);
+        for (int jc = 0; jc < k; jc += NC) {
+            int nc = std::min(NC, k - jc);
+            for (int pc = 0; pc < n; pc += KC) {
+                int kc = std::min(KC, n - pc);
+                for (int ic = 0; ic < m; ic += MC) {
+                    int mc = std::min(MC, m - ic);
+                    int j = 0;
+                    for (; j + 16 <= nc; j += 16) {
+                        int i = 0;
+                        for (; i + 4 <= mc; i += 4) {
+                            micro_avx512(kc, n, k, &A[(ic + i) * n + pc],
+                                         &B[pc * k + jc + j], &C[(ic + i) * k + jc + j]);
+                        }
+                        gemm_edge(mc - i, 16, kc, n, k, &A[(ic + i) * n + pc],
+                                  &B[pc * k + jc + j], &C[(ic + i) * k + jc + j]);
+                    }
+                    gemm_edge(mc, nc - j, kc, n, k, &A[ic * n + pc],
+                              &B[pc * k + jc + j], &C[ic * k + jc + j]);
                 }
+            }
+        }
+    }
+#endif
+
+    static bool kernel_supported(WorkKernel kernel) {
+        switch (kernel) {
+            case WorkKernel::kNaive:
+            case WorkKernel::kBlocked:
+                return true;
+#ifdef WORK_X86
+            case WorkKernel::kAVX2:
+                return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+            case WorkKernel::kAVX512:
+                return __builtin_cpu_supports("avx512f");
+#endif
+            default:
+                return false;
+        }
+    }
+
+    static WorkKernel detect_kernel() {
+        if (kernel_supported(WorkKernel::kAVX512)) return WorkKernel::kAVX512;
+        if (kernel_supported(WorkKernel::kAVX2)) return WorkKernel::kAVX2;
+        return WorkKernel::kBlocked;
+    }
+
+    static GemmKernel kernel_function(WorkKernel kernel) {
+        switch (kernel) {
+            case WorkKernel::kNaive: return gemm_naive;
+#ifdef WORK_X86
+            case WorkKernel::kAVX2: return gemm_avx2;
+            case WorkKernel::kAVX512: return gemm_avx512;
+#endif
+            default: return gemm_blocked;
+        }
+    }
+
+    // The active kernel; resolved on first use if set_work_kernel isn't called
+    static WorkKernel active_kernel = WorkKernel::kAuto;
+    static GemmKernel active_gemm = nullptr;
+
+    bool set_work_kernel(const std::string& name) {
+        WorkKernel kernel;
+        if (name == "auto") kernel = detect_kernel();
+        else if (name == "naive") kernel = WorkKernel::kNaive;
+        else if (name == "blocked") kernel = WorkKernel::kBlocked;
+        else if (name == "avx2") kernel = WorkKernel::kAVX2;
+        else if (name == "avx512") kernel = WorkKernel::kAVX512;
+        else return false;
+
+        if (!kernel_supported(kernel)) return false;
+        active_kernel = kernel;
+        active_gemm = kernel_function(kernel);
+        return true;
+    }
+
+    GemmKernel get_gemm_kernel() {
+        if (active_gemm == nullptr) {
+            set_work_kernel("auto");
+        }
+        return active_gemm;
+    }
+
+    std::string work_kernel_name() {
+        get_gemm_kernel();
+        switch (active_kernel) {
+            case WorkKernel::kNaive: return "naive";
+            case WorkKernel::kBlocked: return "blocked";
+            case WorkKernel::kAVX2: return "avx2";
+            case WorkKernel::kAVX512: return "avx512";
+            default: return "auto";
+        }
+    }
+
+    // Allocates a 64-byte aligned buffer of n doubles and fills it with
+    // deterministic, non-denormal values so that every page is faulted in
+    static double* alloc_operand(size_t n) {
+        void* p = nullptr;
+        if (posix_memalign(&p, 64, std::max<size_t>(n, 1) * sizeof(double)) != 0) {
+            throw std::bad_alloc();
+        }
+        double* d = static_cast<double*>(p);
+        for (size_t i = 0; i < n; ++i) {
+            d[i] = 1.0 + (i % 7) * 0.125;
+        }
+        return d;
+    }
+
+    // Grows buf to hold at least n doubles
+    static void grow_operand(double*& buf, size_t& size, size_t n) {
+        if (n <= size && buf != nullptr) return;
+        free(buf);
+        buf = alloc_operand(n);
+        size = n;
+    }
+
+    MatrixWorkspace::MatrixWorkspace()
+        : a_(nullptr), b_(nullptr), c_(nullptr), a_size_(0), b_size_(0), c_size_(0) {}
+
+    MatrixWorkspace::~MatrixWorkspace() {
+        free(a_);
+        free(b_);
+        free(c_);
+    }
+
+    void MatrixWorkspace::Reserve(const MatrixConfig& config) {
+        grow_operand(a_, a_size_, (size_t) config.m_ * config.n_);
+        grow_operand(b_, b_size_, (size_t) config.n_ * config.k_);
+        grow_operand(c_, c_size_, (size_t) config.m_ * config.k_);
+    }
+
+    double MatrixWorkspace::Multiply(const MatrixConfig& config) {
+        // Only hit when a config wasn't reserved up front
+        Reserve(config);
+
+        get_gemm_kernel()(config.m_, config.n_, config.k_, a_, b_, c_);
 
         double total = 0;
-        for (int i = 0; i < config.m_; ++i)
-            for (int j = 0; j < config.k_; ++j)
-                total += M3[i][j];
-        
+        size_t size = (size_t) config.m_ * config.k_;
+        for (size_t i = 0; i < size; ++i)
+            total += c_[i];
+
         return total;
     }
-}
\ No newline at end of file
+
+    double MatrixWorkspace::MultiplyBatch(const MatrixConfig& config, int count) {
+        return Multiply(MatrixConfig(config.m_ * count, config.n_, config.k_));
+    }
+
+    double matrix_multiply(const MatrixConfig& config) {
+        MatrixWorkspace workspace;
+        return workspace.Multiply(config);
+    }
+}
@@ -7,6 +7,8 @@
 #define SRC_HINDSIGHTGRPC_WORK_H_
 
 #include "iostream"
+#include <cstddef>
+#include <string>
 
 namespace hindsightgrpc {
   /* Configuration for the matrix multiplication task */
@@ -16,13 +18,66 @@ namespace hindsightgrpc {
     MatrixConfig() : m_(50), n_(50), k_(50){}
     int m_, n_, k_;
 
+    /* The number of floating-point operations performed by one multiply */
+    double flops() const { return 2.0 * m_ * n_ * k_; }
+
     friend std::ostream& operator<<(std::ostream& os, const MatrixConfig& mc) {
       os << "[" << mc.m_ << ", " << mc.n_ << ", " << mc.k_ << "]";
       return os;
     }
   };
 
+  /* Computes C = A * B for row-major A (m x n), B (n x k) and C (m x k) */
+  typedef void (*GemmKernel)(int m, int n, int k, const double* A,
+                             const double* B, double* C);
+
+  /* The kernels available to matrix_multiply.  `naive` is the original
+  triple loop and is kept as a reference; `blocked` is a portable cache-blocked
+  kernel; `avx2` and `avx512` are register-blocked SIMD kernels.  `auto` picks
+  the fastest kernel supported by the CPU. */
+  enum class WorkKernel { kAuto, kNaive, kBlocked, kAVX2, kAVX512 };
+
+  /* Selects the kernel used by matrix_multiply.  Returns false if the name is
+  unknown or the kernel is not supported by this CPU.  Not thread-safe; call
+  before starting any handlers. */
+  bool set_work_kernel(const std::string& name);
+
+  /* The name of the kernel currently used by matrix_multiply */
+  std::string work_kernel_name();
+
+  /* The kernel currently used by matrix_multiply */
+  GemmKernel get_gemm_kernel();
+
+  /* Preallocated, cache-line aligned operands for the matrix multiplication
+  task.  Reserve it for the largest MatrixConfig up front; Multiply then reuses
+  the same (already faulted-in) memory for every request instead of allocating
+  on the stack.  Not thread-safe -- each handler thread owns its own. */
+  class MatrixWorkspace {
+    public:
+    MatrixWorkspace();
+    ~MatrixWorkspace();
+
+    /* Grows the workspace so that it can hold the operands of config */
+    void Reserve(const MatrixConfig& config);
+
+    /* Multiplies the inputs for config and returns the sum of the result */
+    double Multiply(const MatrixConfig& config);
+
+    /* Performs count multiplies for config that share their right-hand
+    matrix as one GEMM, with the left-hand matrices stacked into one of
+    count * m rows.  Returns the sum of the result. */
+    double MultiplyBatch(const MatrixConfig& config, int count);
+
+    private:
+    MatrixWorkspace(const MatrixWorkspace&);
+    MatrixWorkspace& operator=(const MatrixWorkspace&);
+
+    double *a_, *b_, *c_;
+    size_t a_size_, b_size_, c_size_;
+  };
+
+  /* Convenience wrapper that uses a temporary workspace */
   double matrix_multiply(const MatrixConfig& config);
 } // namespace hindsightgrpc
 
-#endif  // SRC_HINDSIGHTGRPC_TOPOLOGY_H_
\ No newline at end of file
+#endif  // SRC_HINDSIGHTGRPC_TOPOLOGY_H_
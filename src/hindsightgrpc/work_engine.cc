@@ -0,0 +1,208 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "work_engine.h"
+#include "topology.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WORK_X86 1
+#include <x86intrin.h>
+#endif
+
+namespace hindsightgrpc {
+
+    // Used when the cache sizes can't be read from sysconf
+    static const size_t DEFAULT_LLC_BYTES = 32 * 1024 * 1024;
+    static const size_t DEFAULT_L2_BYTES = 1024 * 1024;
+
+    static size_t llc_bytes() {
+        long size = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+        size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+        return size > 0 ? (size_t) size : DEFAULT_LLC_BYTES;
+    }
+
+    static size_t l2_bytes() {
+        long size = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        return size > 0 ? (size_t) size : DEFAULT_L2_BYTES;
+    }
+
+    // One thread's share of a footprint of total bytes, but never small
+    // enough to fit in its core's L2
+    static size_t share_bytes(size_t total, int threads) {
+        return std::max(total / std::max(threads, 1), 2 * l2_bytes());
+    }
+
+    static void* alloc_aligned(size_t bytes) {
+        void* p = nullptr;
+        if (posix_memalign(&p, 64, bytes) != 0) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    static inline uint64_t read_tsc() {
+#ifdef WORK_X86
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static inline void cpu_relax() {
+#ifdef WORK_X86
+        _mm_pause();
+#endif
+    }
+
+    double tsc_ticks_per_us() {
+        static const double ticks = [] {
+#ifdef WORK_X86
+            auto begin = std::chrono::steady_clock::now();
+            uint64_t tsc_begin = read_tsc();
+            while (std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(20)) {
+                cpu_relax();
+            }
+            uint64_t tsc_end = read_tsc();
+            double us = std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - begin).count();
+            return (tsc_end - tsc_begin) / us;
+#else
+            return 1000.0;
+#endif
+        }();
+        return ticks;
+    }
+
+    static inline std::chrono::steady_clock::time_point deadline_after(double exec_ms) {
+        return std::chrono::steady_clock::now() +
+            std::chrono::nanoseconds((int64_t) (exec_ms * 1000000));
+    }
+
+    double SpinEngine::Run(double exec_ms, const MatrixConfig& /* matrix */) {
+        uint64_t begin = read_tsc();
+        uint64_t end = begin + (uint64_t) (exec_ms * 1000 * tsc_ticks_per_us());
+        uint64_t spins = 0;
+        while (read_tsc() < end) {
+            cpu_relax();
+            spins++;
+        }
+        return spins;
+    }
+
+    StreamEngine::StreamEngine(int threads) : cursor_(0) {
+        // Twice the LLC between all threads so that every pass misses
+        size_ = share_bytes(2 * llc_bytes(), threads) / sizeof(double);
+        buffer_ = static_cast<double*>(alloc_aligned(size_ * sizeof(double)));
+        for (size_t i = 0; i < size_; i++) {
+            buffer_[i] = 1.0;
+        }
+    }
+
+    StreamEngine::~StreamEngine() {
+        free(buffer_);
+    }
+
+    double StreamEngine::Run(double exec_ms, const MatrixConfig& /* matrix */) {
+        // Stream in 256KB chunks, checking the clock between chunks
+        const size_t chunk = 256 * 1024 / sizeof(double);
+        auto deadline = deadline_after(exec_ms);
+        double total = 0;
+        do {
+            size_t end = std::min(cursor_ + chunk, size_);
+            for (size_t i = cursor_; i < end; i++) {
+                total += buffer_[i];
+                buffer_[i] = buffer_[i] * 0.5 + 0.5;
+            }
+            cursor_ = end == size_ ? 0 : end;
+        } while (std::chrono::steady_clock::now() < deadline);
+        return total;
+    }
+
+    ChaseEngine::ChaseEngine(int threads) : current_(0) {
+        // Larger than any L2 but, between all threads, resident in the LLC
+        count_ = share_bytes(llc_bytes() / 2, threads) / sizeof(Node);
+        nodes_ = static_cast<Node*>(alloc_aligned(count_ * sizeof(Node)));
+
+        // Sattolo's algorithm gives a single cycle through every node, in a
+        // random order that defeats the prefetcher
+        std::vector<uint64_t> order(count_);
+        for (size_t i = 0; i < count_; i++) order[i] = i;
+        std::minstd_rand rng(count_);
+        for (size_t i = count_ - 1; i > 0; i--) {
+            std::swap(order[i], order[rng() % i]);
+        }
+        for (size_t i = 0; i < count_; i++) {
+            nodes_[i].next = order[i];
+        }
+    }
+
+    ChaseEngine::~ChaseEngine() {
+        free(nodes_);
+    }
+
+    double ChaseEngine::Run(double exec_ms, const MatrixConfig& /* matrix */) {
+        // Chase in batches of dependent loads, checking the clock between batches
+        auto deadline = deadline_after(exec_ms);
+        uint64_t current = current_;
+        uint64_t hops = 0;
+        do {
+            for (int i = 0; i < 256; i++) {
+                current = nodes_[current].next;
+            }
+            hops += 256;
+        } while (std::chrono::steady_clock::now() < deadline);
+        current_ = current;
+        return hops + current;
+    }
+
+    static const char* WORK_ENGINE_NAMES[] = {"matrix", "spin", "stream", "chase"};
+    static const int NUM_WORK_ENGINES = 4;
+
+    bool valid_work_engine(const std::string& name) {
+        return work_engine_index(name) >= 0;
+    }
+
+    int work_engine_index(const std::string& name) {
+        for (int i = 0; i < NUM_WORK_ENGINES; i++) {
+            if (name == WORK_ENGINE_NAMES[i]) return i;
+        }
+        return -1;
+    }
+
+    WorkEngine* create_work_engine(const std::string& name, int threads) {
+        if (name == "matrix") return new MatrixEngine();
+        if (name == "spin") return new SpinEngine();
+        if (name == "stream") return new StreamEngine(threads);
+        if (name == "chase") return new ChaseEngine(threads);
+        return nullptr;
+    }
+
+    void create_work_engines(ServiceConfig& config, WorkEngines& engines, int threads,
+                             int max_batch) {
+        engines.resize(NUM_WORK_ENGINES);
+        for (auto &p : config.get_apis()) {
+            std::unique_ptr<WorkEngine> &engine = engines[work_engine_index(p.second.engine)];
+            if (!engine) {
+                engine.reset(create_work_engine(p.second.engine, threads));
+            }
+            engine->Reserve(config.get_matrix_config(p.first), std::max(max_batch, 1));
+        }
+    }
+
+}  // namespace hindsightgrpc
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_HINDSIGHTGRPC_WORK_ENGINE_H_
+#define SRC_HINDSIGHTGRPC_WORK_ENGINE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "work.h"
+
+namespace hindsightgrpc {
+  class ServiceConfig;
+
+  /* TSC ticks per microsecond, measured once against the steady clock */
+  double tsc_ticks_per_us();
+
+  /* The synthetic work performed by an API.  Each API in the topology file
+  can pick an engine with its `engine` field:
+
+    matrix  (default) multiplies matrices sized for `exec`; compute-bound
+    spin    busy-waits on the TSC for exactly `exec`; no memory traffic
+    stream  streams over a buffer for `exec`; memory-bandwidth-bound
+    chase   chases pointers around a buffer for `exec`; memory-latency-bound
+
+  Engines are not thread-safe -- each thread that computes owns its own.  The
+  stream and chase engines split their footprint across those threads, so
+  that together the streamed buffers are twice the size of the LLC and the
+  chased buffers fill half of it. */
+  class WorkEngine {
+    public:
+    virtual ~WorkEngine() {}
+
+    /* Prepares the engine for an API that uses matrix, computed alone or in
+    batches of up to max_batch requests; called at startup so that Run and
+    RunBatch don't allocate */
+    virtual void Reserve(const MatrixConfig& /* matrix */, int /* max_batch */) {}
+
+    /* Performs the work for one request.  exec_ms is the API's `exec` value.
+    Returns a value derived from the work so it isn't optimized away. */
+    virtual double Run(double exec_ms, const MatrixConfig& matrix) = 0;
+
+    /* Performs the work for count requests at once, see GemmBatcher.  Only
+    the matrix engine does this better than one request at a time. */
+    virtual double RunBatch(double exec_ms, const MatrixConfig& matrix, int count) {
+      double result = 0;
+      for (int i = 0; i < count; i++) {
+        result += Run(exec_ms, matrix);
+      }
+      return result;
+    }
+  };
+
+  class MatrixEngine : public WorkEngine {
+    public:
+    void Reserve(const MatrixConfig& matrix, int max_batch) {
+      workspace_.Reserve(MatrixConfig(matrix.m_ * max_batch, matrix.n_, matrix.k_));
+    }
+    double Run(double /* exec_ms */, const MatrixConfig& matrix) { return workspace_.Multiply(matrix); }
+    double RunBatch(double /* exec_ms */, const MatrixConfig& matrix, int count) {
+      return workspace_.MultiplyBatch(matrix, count);
+    }
+
+    private:
+    MatrixWorkspace workspace_;
+  };
+
+  class SpinEngine : public WorkEngine {
+    public:
+    SpinEngine() { tsc_ticks_per_us(); }
+    double Run(double exec_ms, const MatrixConfig& matrix);
+  };
+
+  class StreamEngine : public WorkEngine {
+    public:
+    explicit StreamEngine(int threads);
+    ~StreamEngine();
+    double Run(double exec_ms, const MatrixConfig& matrix);
+
+    private:
+    double* buffer_;
+    size_t size_;    // in doubles
+    size_t cursor_;  // resume where the last request stopped, so it stays cold
+  };
+
+  class ChaseEngine : public WorkEngine {
+    public:
+    explicit ChaseEngine(int threads);
+    ~ChaseEngine();
+    double Run(double exec_ms, const MatrixConfig& matrix);
+
+    private:
+    // One node per cache line; next is an index into nodes_
+    struct Node {
+      uint64_t next;
+      uint64_t pad[7];
+    };
+    Node* nodes_;
+    size_t count_;
+    uint64_t current_;
+  };
+
+  /* Returns true if name is one of the engines above */
+  bool valid_work_engine(const std::string& name);
+
+  /* Returns a dense index for the engine name, or -1 if the name is unknown */
+  int work_engine_index(const std::string& name);
+
+  /* Creates an engine by name for one of threads computing threads, or
+  returns nullptr if the name is unknown */
+  WorkEngine* create_work_engine(const std::string& name, int threads);
+
+  /* The engines used by one thread, indexed by work_engine_index; engines
+  that no API uses are null */
+  typedef std::vector<std::unique_ptr<WorkEngine>> WorkEngines;
+
+  /* Creates the engines used by config's APIs for one of threads computing
+  threads, sized for the largest API, or the largest batch of max_batch
+  requests to it if the thread runs GemmBatcher batches */
+  void create_work_engines(ServiceConfig& config, WorkEngines& engines, int threads,
+                           int max_batch = 1);
+
+} // namespace hindsightgrpc
+
+#endif  // SRC_HINDSIGHTGRPC_WORK_ENGINE_H_
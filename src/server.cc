@@ -4,8 +4,12 @@
 
 #include "hindsightgrpc/server.h"
 #include "hindsightgrpc/topology.h"
+#include "hindsightgrpc/calibration.h"
+#include "hindsightgrpc/work_engine.h"
+#include "hindsightgrpc/cpu_affinity.h"
 #include "tracing/opentelemetry.h"
 #include "tracing/hindsight_opentelemetry.h"
+#include <algorithm>
 #include <map>
 #include <string>
 #include <argp.h>
@@ -24,6 +28,31 @@ static char doc[] = "A gRPC-based benchmarking program for building a topology"
                     "t agent.";
 static char args_doc[] = "SERV";
 
+// Options without a short form
+#define OPT_CALIBRATION_CACHE 1000
+#define OPT_CALIBRATION_TOLERANCE 1001
+#define OPT_MATRIX_BENCHMARKS 1002
+#define OPT_COMPUTE_THREADS 1003
+#define OPT_BATCH_CHILDREN 1004
+#define OPT_CHANNELS 1005
+#define OPT_CHANNEL_SELECTION 1006
+#define OPT_SEED 1007
+#define OPT_DETERMINISTIC_FANOUT 1008
+#define OPT_LIMITER 1009
+#define OPT_CQ_THREADS 1010
+#define OPT_ACCEPT_DEPTH 1011
+#define OPT_BUSY_POLL 1012
+#define OPT_CPUS 1013
+#define OPT_SHARDED 1014
+#define OPT_REPLICA_SELECTION 1015
+#define OPT_CHILD_LIMIT 1016
+#define OPT_CHILD_QUEUE 1017
+#define OPT_ADMISSION_QUEUE 1018
+#define OPT_PRIORITY_SCHEDULING 1019
+#define OPT_GEMM_BATCH 1020
+#define OPT_GEMM_BATCH_DELAY 1021
+#define OPT_PERF_SAMPLE 1022
+
 static struct argp_option options[] = {
   {"concurrency",  'c', "NUM",  0,  "The server concurrency, ie the number of request processing threads to run" },
   {"tracing",  'x', "TRACER",  0,  "Tracing to use, optional.  TRACER can be one of: "
@@ -37,8 +66,70 @@ static struct argp_option options[] = {
                                    "`ot-hindsight` Hindsight's OpenTelemetry tracer.  It's better to use hindsight than ot-hindsight."},
   {"trigger",  'f', "ID:P",  0,  "Install a trigger for queue ID with probability P.  " },
   {"nocompute",  'n', 0,  0,  "Disables RPC computation, overriding the `exec` value from the topology file.  This makes all RPCs do no computation and return immediately." },
+  {"work_kernel",  'k', "KERNEL",  0,  "The matrix multiplication kernel used for RPC computation.  KERNEL can be one of: "
+                                       "auto, naive, blocked, avx2, avx512.  `auto` picks the fastest kernel supported by the CPU.  "
+                                       "`naive` is the original unblocked triple loop, kept as a reference; config/matrix_benchmarks.csv was "
+                                       "measured with it.  Default auto." },
+  {"calibrate",  'C', 0,  0,  "Calibrate the matrix sizes used for RPC computation against the `exec` values in the topology file by "
+                              "benchmarking the work kernel on this machine, even if --matrix_benchmarks is given.  "
+                              "This is the default.  The fitted cost model is cached per CPU model and kernel." },
+  {"calibration_cache", OPT_CALIBRATION_CACHE, "FILE", 0, "Where to cache calibrated cost models.  Set to `none` to always recalibrate.  "
+                                                          "Default $XDG_CACHE_HOME/microbricks/work_model.csv" },
+  {"calibration_tolerance", OPT_CALIBRATION_TOLERANCE, "PCT", 0, "How close, in percent, calibrated matrix sizes must come to the `exec` value.  Default 5." },
+  {"matrix_benchmarks", OPT_MATRIX_BENCHMARKS, "FILE", 0, "Instead of calibrating, use the matrix sizes measured in a static benchmarks file, "
+                                                          "eg ../config/matrix_benchmarks.csv, which was measured with the naive kernel on another machine." },
+  {"compute_threads", OPT_COMPUTE_THREADS, "NUM", 0, "Run API computation on a separate pool of NUM work-stealing compute threads, "
+                                                    "so that the handler threads only poll their completion queues.  "
+                                                    "Default 0, which computes inline on the handler threads." },
+  {"gemm_batch", OPT_GEMM_BATCH, "NUM", 0, "Compute up to NUM concurrent requests for the same matrix sizes together, as one matrix multiplication.  "
+                                          "Only applies to the matrix work kernel.  Default 1, which computes each request on its own." },
+  {"gemm_batch_delay", OPT_GEMM_BATCH_DELAY, "USEC", 0, "How long a request may wait for others to join its --gemm_batch batch.  Default 200." },
+  {"perf_sample", OPT_PERF_SAMPLE, "N", 0, "Measure one in N requests with hardware performance counters and thread CPU time, "
+                                           "split into tracing, work and gRPC.  Reported by the Stats RPC and --debug.  "
+                                           "Default 0, which measures none." },
+  {"batch_children", OPT_BATCH_CHILDREN, 0, 0, "If this flag is set, a request's child calls to the same server are sent together as one ExecBatch RPC.  "
+                                               "Each child call still records its own spans, propagates its own trace context, "
+                                               "gets its own status, and is admitted by the receiving server like any other request." },
+  {"channels", OPT_CHANNELS, "NUM", 0, "The number of connections to open to each child server.  Default 1." },
+  {"channel_selection", OPT_CHANNEL_SELECTION, "POLICY", 0, "How child calls pick one of the connections to a child server.  POLICY can be one of: "
+                                                            "round_robin, least_loaded.  `least_loaded` picks the connection with the fewest outstanding calls.  "
+                                                            "Default round_robin." },
+  {"replica_selection", OPT_REPLICA_SELECTION, "POLICY", 0, "How child calls pick one of several instances of a service.  POLICY can be one of: "
+                                                            "random, p2c, least_outstanding, weighted.  `p2c` picks the less loaded of two random instances, "
+                                                            "by outstanding calls and average latency.  `least_outstanding` picks the instance with the fewest outstanding calls.  "
+                                                            "`weighted` takes turns in proportion to each instance's `weight` in the addresses file.  Default random." },
+  {"child_limit", OPT_CHILD_LIMIT, "NUM", 0, "The maximum number of outstanding calls to each child server.  Further calls wait in a queue, "
+                                            "and fail with RESOURCE_EXHAUSTED if the queue is full.  Default 0, which is unlimited." },
+  {"child_queue", OPT_CHILD_QUEUE, "NUM", 0, "The number of calls to each child server that may wait for --child_limit.  Default 100." },
+  {"seed", OPT_SEED, "NUM", 0, "Seed for the random number generators used for fan-out and trigger decisions.  "
+                               "Default 0, which picks a random seed and prints it." },
+  {"deterministic_fanout", OPT_DETERMINISTIC_FANOUT, 0, 0, "If this flag is set, fan-out decisions are derived from a per-trace key chosen by the client, "
+                                                           "so that a trace makes the same decisions on every run and with every tracer." },
+  {"cq_threads", OPT_CQ_THREADS, "NUM", 0, "The number of threads polling each handler's completion queue.  "
+                                          "Use with fewer handlers than cores to share each queue across cores.  Default 1." },
+  {"accept_depth", OPT_ACCEPT_DEPTH, "NUM", 0, "The number of incoming RPCs each handler is ready to accept at once, "
+                                              "ie the number of RequestExec calls it keeps posted.  Default 1." },
+  {"busy_poll", OPT_BUSY_POLL, "USEC", 0, "Handler threads poll their completion queues without blocking, "
+                                        "and only block after USEC microseconds without an event.  -1 never blocks.  "
+                                        "Default 0, which always blocks." },
+  {"cpus", OPT_CPUS, "LIST", 0, "Pin the handler threads to the CPUs in LIST, eg 0-3,8,10-11, in order.  "
+                                "Each handler's completion queue and request memory is allocated on its CPU's NUMA node.  "
+                                "Default unpinned." },
+  {"sharded", OPT_SHARDED, 0, 0, "If this flag is set, each handler has its own connections to child servers, routing table and counters, "
+                                "and handlers share no mutable state.  Implies --cq_threads=1 and --compute_threads=0; "
+                                "use with --cpus to run one handler per core." },
   {"debug",  'd', 0,  0,  "Turn on debug printing" },
   {"max_requests",  'm', "NUM",  0,  "Maximum number of concurrently-executing requests per handler.  Default 100" },
+  {"limiter", OPT_LIMITER, "LIMITER", 0, "How each handler limits its concurrently-executing requests.  LIMITER can be one of: "
+                                         "gradient, static.  `gradient` adapts the limit, up to --max_requests, to measured request latency.  "
+                                         "`static` always admits --max_requests.  Requests over the limit are rejected with RESOURCE_EXHAUSTED.  "
+                                         "Default gradient." },
+  {"admission_queue", OPT_ADMISSION_QUEUE, "NUM", 0, "The number of requests over the limit that each handler may queue rather than reject.  "
+                                                    "When the queue is full, a request displaces a queued request of lower priority, if there is one.  "
+                                                    "Default 0, which rejects all requests over the limit." },
+  {"priority_scheduling", OPT_PRIORITY_SCHEDULING, "POLICY", 0, "How queued requests and computation are ordered by API priority.  POLICY can be one of: "
+                                                                "strict, weighted.  `strict` always serves the highest priority first.  "
+                                                                "`weighted` serves each priority in proportion to priority+1.  Default strict." },
   {"topology", 't', "FILE", 0, "A topology file.  This is required.  See config/example_topology.json for an example." },
   {"addresses", 'a', "FILE", 0, "An addresses file.  This is required.  See config/example_addresses.json for an example." },
   {"otel_host", 'h', "HOST", 0, "Address of the OpenTelemetry collector to send spans. This is required for ot-jaeger." },
@@ -51,6 +142,11 @@ static struct argp_option options[] = {
 struct arguments {
   std::string tracing;
   bool nocompute;
+  std::string work_kernel;
+  bool calibrate;
+  std::string calibration_cache;
+  double calibration_tolerance;
+  std::string matrix_benchmarks;
   int server_threads;
   char* service_name;
   char* topology_filename;
@@ -60,6 +156,26 @@ struct arguments {
   bool otel_batch_exporter;
   int instance_id;
   int max_requests;
+  std::string limiter;
+  int admission_queue;
+  std::string priority_scheduling;
+  int cq_threads;
+  int accept_depth;
+  int busy_poll;
+  std::string cpus;
+  bool sharded;
+  int compute_threads;
+  int gemm_batch;
+  int gemm_batch_delay;
+  int perf_sample;
+  bool batch_children;
+  int channels;
+  std::string channel_selection;
+  std::string replica_selection;
+  int child_limit;
+  int child_queue;
+  uint64_t seed;
+  bool deterministic_fanout;
   std::map<int, float> triggers;
   bool debug;
 };
@@ -78,6 +194,21 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     case 'n':
       arguments->nocompute = true;
       break;
+    case 'k':
+      arguments->work_kernel = std::string(arg);
+      break;
+    case 'C':
+      arguments->calibrate = true;
+      break;
+    case OPT_CALIBRATION_CACHE:
+      arguments->calibration_cache = std::string(arg);
+      break;
+    case OPT_CALIBRATION_TOLERANCE:
+      arguments->calibration_tolerance = atof(arg);
+      break;
+    case OPT_MATRIX_BENCHMARKS:
+      arguments->matrix_benchmarks = std::string(arg);
+      break;
     case 't':
       arguments->topology_filename = arg;
       break;
@@ -112,6 +243,66 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     case 's':
       arguments->otel_batch_exporter = false;
       break;
+    case OPT_COMPUTE_THREADS:
+      arguments->compute_threads = atoi(arg);
+      break;
+    case OPT_GEMM_BATCH:
+      arguments->gemm_batch = atoi(arg);
+      break;
+    case OPT_GEMM_BATCH_DELAY:
+      arguments->gemm_batch_delay = atoi(arg);
+      break;
+    case OPT_PERF_SAMPLE:
+      arguments->perf_sample = atoi(arg);
+      break;
+    case OPT_BATCH_CHILDREN:
+      arguments->batch_children = true;
+      break;
+    case OPT_CHANNELS:
+      arguments->channels = atoi(arg);
+      break;
+    case OPT_CHANNEL_SELECTION:
+      arguments->channel_selection = arg;
+      break;
+    case OPT_REPLICA_SELECTION:
+      arguments->replica_selection = arg;
+      break;
+    case OPT_CHILD_LIMIT:
+      arguments->child_limit = atoi(arg);
+      break;
+    case OPT_CHILD_QUEUE:
+      arguments->child_queue = atoi(arg);
+      break;
+    case OPT_SEED:
+      arguments->seed = strtoull(arg, NULL, 10);
+      break;
+    case OPT_DETERMINISTIC_FANOUT:
+      arguments->deterministic_fanout = true;
+      break;
+    case OPT_LIMITER:
+      arguments->limiter = arg;
+      break;
+    case OPT_ADMISSION_QUEUE:
+      arguments->admission_queue = atoi(arg);
+      break;
+    case OPT_PRIORITY_SCHEDULING:
+      arguments->priority_scheduling = arg;
+      break;
+    case OPT_CQ_THREADS:
+      arguments->cq_threads = atoi(arg);
+      break;
+    case OPT_ACCEPT_DEPTH:
+      arguments->accept_depth = atoi(arg);
+      break;
+    case OPT_BUSY_POLL:
+      arguments->busy_poll = atoi(arg);
+      break;
+    case OPT_CPUS:
+      arguments->cpus = arg;
+      break;
+    case OPT_SHARDED:
+      arguments->sharded = true;
+      break;
     case 'i':
       arguments->instance_id = atoi(arg);
       break;
@@ -148,6 +339,11 @@ int main(int argc, char** argv) {
   /* Default values. */
   arguments.tracing = "none";
   arguments.nocompute = false;
+  arguments.work_kernel = "auto";
+  arguments.calibrate = false;
+  arguments.calibration_cache = hindsightgrpc::default_calibration_cache();
+  arguments.calibration_tolerance = 5;
+  arguments.matrix_benchmarks = "";
   arguments.server_threads = 1;
   arguments.service_name = NULL;
   arguments.topology_filename = NULL;
@@ -158,6 +354,26 @@ int main(int argc, char** argv) {
   arguments.debug = false;
   arguments.instance_id = 0;
   arguments.max_requests = 100;
+  arguments.limiter = "gradient";
+  arguments.admission_queue = 0;
+  arguments.priority_scheduling = "strict";
+  arguments.cq_threads = 1;
+  arguments.accept_depth = 1;
+  arguments.busy_poll = 0;
+  arguments.cpus = "";
+  arguments.sharded = false;
+  arguments.compute_threads = 0;
+  arguments.gemm_batch = 1;
+  arguments.gemm_batch_delay = 200;
+  arguments.perf_sample = 0;
+  arguments.batch_children = false;
+  arguments.channels = 1;
+  arguments.channel_selection = "round_robin";
+  arguments.replica_selection = "random";
+  arguments.child_limit = 0;
+  arguments.child_queue = 100;
+  arguments.seed = 0;
+  arguments.deterministic_fanout = false;
 
   /* Parse the arguments */
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
@@ -196,8 +412,112 @@ int main(int argc, char** argv) {
     return 1; 
   }
 
+  /* Check the work engines requested by the topology */
+  for (auto &p : service_config.get_apis()) {
+    if (!hindsightgrpc::valid_work_engine(p.second.engine)) {
+      std::cerr << "Unknown work engine " << p.second.engine << " for api " << p.first << std::endl;
+      return 1;
+    }
+  }
+
+  /* Select the matrix multiplication kernel */
+  if (!hindsightgrpc::set_work_kernel(arguments.work_kernel)) {
+    std::cerr << "Unknown or unsupported work kernel " << arguments.work_kernel << std::endl;
+    return 1;
+  }
+  std::cout << "Using " << hindsightgrpc::work_kernel_name() << " work kernel" << std::endl;
+
+  /* Select how child calls pick a connection */
+  int channel_selection;
+  if (arguments.channel_selection == "round_robin") {
+    channel_selection = hindsightgrpc::ChildClient::ROUND_ROBIN;
+  } else if (arguments.channel_selection == "least_loaded") {
+    channel_selection = hindsightgrpc::ChildClient::LEAST_LOADED;
+  } else {
+    std::cerr << "Unknown channel selection " << arguments.channel_selection << std::endl;
+    return 1;
+  }
+
+  /* Select how child calls pick a service instance */
+  int replica_selection;
+  if (arguments.replica_selection == "random") {
+    replica_selection = hindsightgrpc::RANDOM_REPLICA;
+  } else if (arguments.replica_selection == "p2c") {
+    replica_selection = hindsightgrpc::POWER_OF_TWO;
+  } else if (arguments.replica_selection == "least_outstanding") {
+    replica_selection = hindsightgrpc::LEAST_OUTSTANDING;
+  } else if (arguments.replica_selection == "weighted") {
+    replica_selection = hindsightgrpc::WEIGHTED_ROUND_ROBIN;
+  } else {
+    std::cerr << "Unknown replica selection " << arguments.replica_selection << std::endl;
+    return 1;
+  }
+
+  /* Select how handlers limit concurrent requests */
+  int limiter_mode;
+  if (arguments.limiter == "gradient") {
+    limiter_mode = hindsightgrpc::ConcurrencyLimiter::GRADIENT;
+  } else if (arguments.limiter == "static") {
+    limiter_mode = hindsightgrpc::ConcurrencyLimiter::STATIC;
+  } else {
+    std::cerr << "Unknown limiter " << arguments.limiter << std::endl;
+    return 1;
+  }
+
+  /* Select how queued requests and computation are ordered by priority */
+  int priority_scheduling;
+  if (arguments.priority_scheduling == "strict") {
+    priority_scheduling = hindsightgrpc::STRICT_PRIORITY;
+  } else if (arguments.priority_scheduling == "weighted") {
+    priority_scheduling = hindsightgrpc::WEIGHTED_FAIR;
+  } else {
+    std::cerr << "Unknown priority scheduling " << arguments.priority_scheduling << std::endl;
+    return 1;
+  }
+
+  /* Parse the CPUs to pin handler threads to */
+  std::vector<int> cpus;
+  if (arguments.cpus != "" && !hindsightgrpc::parse_cpu_list(arguments.cpus, cpus)) {
+    std::cerr << "Invalid CPU list " << arguments.cpus << std::endl;
+    return 1;
+  }
+
+  /* Sharded handlers don't share threads or a compute pool */
+  if (arguments.sharded) {
+    if (arguments.cq_threads > 1 || arguments.compute_threads > 0) {
+      std::cout << "Ignoring --cq_threads and --compute_threads in sharded mode" << std::endl;
+    }
+    arguments.cq_threads = 1;
+    arguments.compute_threads = 0;
+  }
+
   /* Generate the matrix multiplication configs for the APIs */
-  service_config.generate_matrix_configs();
+  bool calibrate = arguments.calibrate || arguments.matrix_benchmarks == "";
+  if (!calibrate && hindsightgrpc::work_kernel_name() != "naive") {
+    std::cout << "Warning: " << arguments.matrix_benchmarks << " was measured with the naive kernel, so APIs will "
+              << "compute for less than their `exec` values; calibrate instead to match the " << hindsightgrpc::work_kernel_name()
+              << " kernel" << std::endl;
+  }
+  if (!calibrate && !service_config.generate_matrix_configs(arguments.matrix_benchmarks)) {
+    std::cerr << "Unable to open matrix benchmarks " << arguments.matrix_benchmarks << std::endl;
+    return 1;
+  }
+  if (calibrate) {
+    hindsightgrpc::MatrixWorkspace workspace;
+    hindsightgrpc::WorkModel model;
+    bool cached = arguments.calibration_cache != "none";
+    if (cached && hindsightgrpc::load_work_model(arguments.calibration_cache, model)) {
+      std::cout << "Loaded work model from " << arguments.calibration_cache << std::endl;
+    } else {
+      std::cout << "Calibrating work model for " << hindsightgrpc::cpu_model_name() << std::endl;
+      model = hindsightgrpc::WorkModel::Calibrate(workspace);
+      if (cached && !hindsightgrpc::save_work_model(arguments.calibration_cache, model)) {
+        std::cerr << "Unable to write work model to " << arguments.calibration_cache << std::endl;
+      }
+    }
+    std::cout << "Work model " << model << std::endl;
+    service_config.calibrate_matrix_configs(model, workspace, arguments.calibration_tolerance / 100.0);
+  }
   service_config.print_matrix_configs();  
 
   /* Configure tracing */
@@ -269,10 +589,25 @@ int main(int argc, char** argv) {
     std::cout << "Trigger " << p.first << "=" << p.second << std::endl;
   }
 
+  /* Seed the random number generators */
+  uint64_t seed = arguments.seed != 0 ? arguments.seed : hindsightgrpc::random_seed();
+  std::cout << "Using seed " << seed << std::endl;
+
   // Start the server
   hindsightgrpc::ServerImpl server(service_config, addresses,
                                    arguments.nocompute, arguments.triggers,
-                                   arguments.instance_id, arguments.max_requests);
+                                   arguments.instance_id, arguments.max_requests,
+                                   arguments.compute_threads, arguments.batch_children,
+                                   arguments.channels, channel_selection,
+                                   seed, arguments.deterministic_fanout,
+                                   limiter_mode, std::max(arguments.cq_threads, 1),
+                                   std::max(arguments.accept_depth, 1),
+                                   arguments.busy_poll, cpus, arguments.sharded,
+                                   replica_selection, std::max(arguments.child_limit, 0),
+                                   std::max(arguments.child_queue, 0),
+                                   std::max(arguments.admission_queue, 0), priority_scheduling,
+                                   arguments.gemm_batch, std::max(arguments.gemm_batch_delay, 0),
+                                   std::max(arguments.perf_sample, 0));
   server.Run(arguments.server_threads, arguments.debug);
   server.Join();
 
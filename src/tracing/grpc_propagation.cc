@@ -44,6 +44,20 @@ void GrpcServerCarrier::Set(nostd::string_view key, nostd::string_view value) no
   // Not required for server
 }
 
+GrpcBatchedCallCarrier::GrpcBatchedCallCarrier(Metadata *metadata) : metadata_(metadata) {}
+
+nostd::string_view GrpcBatchedCallCarrier::Get(nostd::string_view key) const noexcept {
+  auto it = metadata_->find(std::string(key.data(), key.size()));
+  if (it != metadata_->end()) {
+    return it->second;
+  }
+  return "";
+}
+
+void GrpcBatchedCallCarrier::Set(nostd::string_view key, nostd::string_view value) noexcept {
+  (*metadata_)[std::string(key.data(), key.size())] = std::string(value.data(), value.size());
+}
+
 void initGrpcPropagation() {
   // Set the global propagator
   propagation::GlobalTextMapPropagator::SetGlobalPropagator(
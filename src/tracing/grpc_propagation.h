@@ -6,6 +6,7 @@
 #ifndef SRC_TRACING_GRPC_PROPAGATION_H_
 #define SRC_TRACING_GRPC_PROPAGATION_H_
 
+#include <google/protobuf/map.h>
 #include <grpcpp/grpcpp.h>
 #include "opentelemetry/context/propagation/text_map_propagator.h"
 #include "opentelemetry/nostd/string_view.h"
@@ -49,6 +50,21 @@ public:
 };
 
 
+/* Propagates string KV pairs inside the metadata of one of the calls of an
+ExecBatch, which share the batch's gRPC context.  Both sides. */
+class GrpcBatchedCallCarrier : public TextMapCarrier {
+public:
+  typedef google::protobuf::Map<std::string, std::string> Metadata;
+
+  GrpcBatchedCallCarrier(Metadata *metadata);
+
+  nostd::string_view Get(nostd::string_view key) const noexcept override;
+  virtual void Set(nostd::string_view key, nostd::string_view value) noexcept override;
+
+  Metadata *metadata_;
+};
+
+
 } // namespace hindsightgrpc
 
 #endif  // SRC_TRACING_GRPC_PROPAGATION_H_
\ No newline at end of file
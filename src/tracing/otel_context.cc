@@ -0,0 +1,72 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "otel_context.h"
+
+#include <string>
+
+#include "opentelemetry/nostd/span.h"
+#include "opentelemetry/nostd/string_view.h"
+#include "opentelemetry/trace/propagation/detail/hex.h"
+
+namespace hindsightgrpc {
+
+namespace nostd = opentelemetry::nostd;
+namespace detail = opentelemetry::trace::propagation::detail;
+using opentelemetry::trace::TraceId;
+using opentelemetry::trace::SpanId;
+
+// The binary fields hold the ids big-endian, so that they read the same as
+// the hex strings
+static uint64_t load_be64(const uint8_t* bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value = (value << 8) | bytes[i];
+  }
+  return value;
+}
+
+static void store_be64(uint64_t value, uint8_t* bytes) {
+  for (int i = 7; i >= 0; i--) {
+    bytes[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+void set_otel_context_ids(OtelContext* context, const TraceId& trace_id,
+                          const SpanId& span_id, bool binary) {
+  if (binary) {
+    context->set_bin_trace_id_high(load_be64(trace_id.Id().data()));
+    context->set_bin_trace_id_low(load_be64(trace_id.Id().data() + 8));
+    context->set_bin_span_id(load_be64(span_id.Id().data()));
+  } else {
+    char tid_buffer[32];
+    trace_id.ToLowerBase16(nostd::span<char, 32>{&tid_buffer[0], 32});
+    context->set_trace_id(tid_buffer, 32);
+    char sid_buffer[16];
+    span_id.ToLowerBase16(nostd::span<char, 16>{&sid_buffer[0], 16});
+    context->set_span_id(sid_buffer, 16);
+  }
+}
+
+bool get_otel_context_ids(const OtelContext& context,
+                          uint8_t trace_id[16], uint8_t span_id[8]) {
+  // An all-zero trace id is invalid, so zero means the binary fields are unset
+  if (context.bin_trace_id_high() != 0 || context.bin_trace_id_low() != 0) {
+    store_be64(context.bin_trace_id_high(), trace_id);
+    store_be64(context.bin_trace_id_low(), trace_id + 8);
+    store_be64(context.bin_span_id(), span_id);
+    return true;
+  }
+
+  auto trace_id_hex = nostd::string_view(context.trace_id());
+  auto span_id_hex = nostd::string_view(context.span_id());
+  if (!detail::IsValidHex(trace_id_hex) || !detail::IsValidHex(span_id_hex)) {
+    return false;
+  }
+  return detail::HexToBinary(trace_id_hex, trace_id, 16) &&
+         detail::HexToBinary(span_id_hex, span_id, 8);
+}
+
+}  // namespace hindsightgrpc
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#pragma once
+#ifndef SRC_TRACING_OTEL_CONTEXT_H_
+#define SRC_TRACING_OTEL_CONTEXT_H_
+
+#include <cstdint>
+
+#include "hindsightgrpc.pb.h"
+#include "opentelemetry/trace/span_id.h"
+#include "opentelemetry/trace/trace_id.h"
+
+namespace hindsightgrpc {
+
+/* Writes trace and span ids into an OtelContext message.
+
+If binary is true the ids go in the fixed64 fields, which costs no
+allocations or hex conversions.  Otherwise they go in the lowercase hex
+string fields, which is what peers that predate the binary fields expect.
+A peer advertises that it understands the binary fields by setting
+binary_trace_context in its ExecReply. */
+void set_otel_context_ids(OtelContext* context,
+                          const opentelemetry::trace::TraceId& trace_id,
+                          const opentelemetry::trace::SpanId& span_id,
+                          bool binary);
+
+/* Reads trace and span ids from an OtelContext message, preferring the
+binary fields and falling back to the hex strings.  Returns false if
+neither form holds a valid id. */
+bool get_otel_context_ids(const OtelContext& context,
+                          uint8_t trace_id[16], uint8_t span_id[8]);
+
+}  // namespace hindsightgrpc
+
+#endif  // SRC_TRACING_OTEL_CONTEXT_H_
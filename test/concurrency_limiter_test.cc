@@ -0,0 +1,76 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "concurrency_limiter.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+using hindsightgrpc::ConcurrencyLimiter;
+
+// Completes n requests of the given latency with the limit fully used
+static void complete(ConcurrencyLimiter& limiter, int n, uint64_t latency_ns) {
+  for (int i = 0; i < n; i++) {
+    limiter.OnComplete(latency_ns, limiter.limit());
+  }
+}
+
+TEST(ConcurrencyLimiter, StaticAlwaysAdmitsMax) {
+  ConcurrencyLimiter limiter(ConcurrencyLimiter::STATIC, 100);
+  EXPECT_EQ(limiter.limit(), 100);
+  complete(limiter, 100, 1000000);
+  complete(limiter, 100, 100000000);
+  EXPECT_EQ(limiter.limit(), 100);
+  EXPECT_TRUE(limiter.Admit(99));
+  EXPECT_FALSE(limiter.Admit(100));
+}
+
+TEST(ConcurrencyLimiter, GradientStartsBelowMax) {
+  EXPECT_EQ(ConcurrencyLimiter(ConcurrencyLimiter::GRADIENT, 100).limit(), 20);
+  EXPECT_EQ(ConcurrencyLimiter(ConcurrencyLimiter::GRADIENT, 5).limit(), 5);
+}
+
+TEST(ConcurrencyLimiter, GradientGrowsToMaxWhileLatencyIsFlat) {
+  ConcurrencyLimiter limiter(ConcurrencyLimiter::GRADIENT, 100);
+  complete(limiter, 500, 1000000);
+  EXPECT_EQ(limiter.limit(), 100);
+}
+
+TEST(ConcurrencyLimiter, GradientDoesNotGrowWhenUnused) {
+  ConcurrencyLimiter limiter(ConcurrencyLimiter::GRADIENT, 100);
+  for (int i = 0; i < 500; i++) {
+    limiter.OnComplete(1000000, 1);
+  }
+  EXPECT_EQ(limiter.limit(), 20);
+}
+
+TEST(ConcurrencyLimiter, GradientShrinksWhenLatencyRises) {
+  ConcurrencyLimiter limiter(ConcurrencyLimiter::GRADIENT, 100);
+  complete(limiter, 500, 1000000);
+  complete(limiter, 100, 10000000);
+  EXPECT_LT(limiter.limit(), 50);
+  EXPECT_GE(limiter.limit(), 1);
+}
+
+// A steady workload keeps a steady limit, without periodic dips
+TEST(ConcurrencyLimiter, GradientIsStableUnderSteadyLatency) {
+  ConcurrencyLimiter limiter(ConcurrencyLimiter::GRADIENT, 100);
+  complete(limiter, 500, 1000000);
+  int lowest = limiter.limit();
+  for (int i = 0; i < 10000; i++) {
+    limiter.OnComplete(1000000, limiter.limit());
+    lowest = std::min(lowest, limiter.limit());
+  }
+  EXPECT_EQ(lowest, 100);
+}
+
+// Once the service has been slower for two windows, that is its new normal
+TEST(ConcurrencyLimiter, GradientFollowsSlowerService) {
+  ConcurrencyLimiter limiter(ConcurrencyLimiter::GRADIENT, 100);
+  complete(limiter, 2000, 1000000);
+  complete(limiter, 2000, 10000000);
+  complete(limiter, 500, 10000000);
+  EXPECT_EQ(limiter.limit(), 100);
+}
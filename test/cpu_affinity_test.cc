@@ -0,0 +1,64 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "cpu_affinity.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <string>
+#include <vector>
+
+using hindsightgrpc::parse_cpu_list;
+
+static std::vector<int> parse(const std::string& list) {
+  std::vector<int> cpus;
+  EXPECT_TRUE(parse_cpu_list(list, cpus)) << list;
+  return cpus;
+}
+
+static bool malformed(const std::string& list) {
+  std::vector<int> cpus;
+  return !parse_cpu_list(list, cpus);
+}
+
+TEST(ParseCpuList, SinglesAndRanges) {
+  EXPECT_EQ(parse("5"), std::vector<int>({5}));
+  EXPECT_EQ(parse("0-3"), std::vector<int>({0, 1, 2, 3}));
+  EXPECT_EQ(parse("0-3,8,10-11"), std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(parse("2-2"), std::vector<int>({2}));
+}
+
+TEST(ParseCpuList, KeepsTheGivenOrder) {
+  EXPECT_EQ(parse("4,0-1"), std::vector<int>({4, 0, 1}));
+}
+
+TEST(ParseCpuList, RejectsMalformedLists) {
+  EXPECT_TRUE(malformed(""));
+  EXPECT_TRUE(malformed("a"));
+  EXPECT_TRUE(malformed("-1"));
+  EXPECT_TRUE(malformed("1-"));
+  EXPECT_TRUE(malformed("3-1"));
+  EXPECT_TRUE(malformed("1,,2"));
+  EXPECT_TRUE(malformed("1 ,2"));
+  EXPECT_TRUE(malformed(std::to_string(CPU_SETSIZE)));
+}
+
+TEST(PinCurrentThread, UnpinRestoresTheOriginalAffinity) {
+  cpu_set_t original;
+  ASSERT_EQ(pthread_getaffinity_np(pthread_self(), sizeof(original), &original), 0);
+  int cpu = 0;
+  while (!CPU_ISSET(cpu, &original)) cpu++;
+
+  ASSERT_TRUE(hindsightgrpc::pin_current_thread(cpu));
+  cpu_set_t pinned;
+  pthread_getaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+  EXPECT_EQ(CPU_COUNT(&pinned), 1);
+
+  hindsightgrpc::unpin_current_thread();
+  cpu_set_t restored;
+  pthread_getaffinity_np(pthread_self(), sizeof(restored), &restored);
+  EXPECT_TRUE(CPU_EQUAL(&restored, &original));
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "histogram.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+using hindsightgrpc::HistogramSnapshot;
+using hindsightgrpc::LatencyHistogram;
+
+// Copies, since gtest takes its arguments by reference
+static const int buckets = LatencyHistogram::buckets;
+static const int max_bits = LatencyHistogram::max_bits;
+
+TEST(LatencyHistogram, SmallLatenciesHaveABucketEach) {
+  for (uint64_t latency = 0; latency < 32; latency++) {
+    EXPECT_EQ(LatencyHistogram::Bucket(latency), (int) latency);
+    EXPECT_EQ(LatencyHistogram::LowerBound((int) latency), latency);
+  }
+}
+
+TEST(LatencyHistogram, BucketsAreLogLinear) {
+  EXPECT_EQ(LatencyHistogram::Bucket(32), 32);
+  EXPECT_EQ(LatencyHistogram::Bucket(33), 32);
+  EXPECT_EQ(LatencyHistogram::Bucket(34), 33);
+  EXPECT_EQ(LatencyHistogram::LowerBound(33), 34u);
+  EXPECT_EQ(LatencyHistogram::Bucket(1000000), LatencyHistogram::Bucket(1000000 + 1000));
+}
+
+// Every latency falls between its bucket's lower bound and the next one's,
+// and above the first 16 each bucket is within 1/16th of the latencies in it
+TEST(LatencyHistogram, BucketsCoverTheirLatencies) {
+  int previous = 0;
+  for (uint64_t latency = 1; latency < (1ULL << max_bits); latency += latency / 7 + 1) {
+    int bucket = LatencyHistogram::Bucket(latency);
+    ASSERT_GE(bucket, previous);
+    ASSERT_LT(bucket, buckets);
+    uint64_t lower = LatencyHistogram::LowerBound(bucket);
+    uint64_t upper = LatencyHistogram::LowerBound(bucket + 1);
+    ASSERT_LE(lower, latency);
+    ASSERT_LT(latency, upper);
+    if (latency >= 16) {
+      ASSERT_LE((upper - lower) * 16, lower);
+    }
+    previous = bucket;
+  }
+}
+
+TEST(LatencyHistogram, HugeLatenciesGoInTheLastBucket) {
+  EXPECT_EQ(LatencyHistogram::Bucket(1ULL << max_bits), buckets - 1);
+  EXPECT_EQ(LatencyHistogram::Bucket(UINT64_MAX), buckets - 1);
+}
+
+TEST(HistogramSnapshot, EmptyHasNoPercentiles) {
+  HistogramSnapshot snapshot;
+  EXPECT_EQ(snapshot.count(), 0u);
+  EXPECT_EQ(snapshot.Mean(), 0u);
+  EXPECT_EQ(snapshot.Percentile(50), 0u);
+}
+
+TEST(HistogramSnapshot, PercentilesAreBucketMidpoints) {
+  LatencyHistogram histogram;
+  for (int i = 0; i < 90; i++) histogram.Record(1000);
+  for (int i = 0; i < 10; i++) histogram.Record(1000000);
+  HistogramSnapshot snapshot;
+  snapshot.Merge(histogram);
+
+  EXPECT_EQ(snapshot.count(), 100u);
+  EXPECT_EQ(snapshot.total(), 90u * 1000 + 10u * 1000000);
+  EXPECT_EQ(snapshot.Mean(), (90u * 1000 + 10u * 1000000) / 100);
+
+  // 1000 is in [992, 1024) and 1000000 in [983040, 1015808)
+  EXPECT_EQ(snapshot.Percentile(50), 1008u);
+  EXPECT_EQ(snapshot.Percentile(90), 1008u);
+  EXPECT_EQ(snapshot.Percentile(99), 999424u);
+  EXPECT_EQ(snapshot.Percentile(100), 999424u);
+}
+
+TEST(HistogramSnapshot, MergeAddsAndSinceSubtracts) {
+  LatencyHistogram a, b;
+  a.Record(100);
+  b.Record(100);
+  b.Record(5000);
+  HistogramSnapshot earlier;
+  earlier.Merge(a);
+  earlier.Merge(b);
+  EXPECT_EQ(earlier.count(), 3u);
+  EXPECT_EQ(earlier.count(LatencyHistogram::Bucket(100)), 2u);
+
+  a.Record(5000);
+  HistogramSnapshot later;
+  later.Merge(a);
+  later.Merge(b);
+  HistogramSnapshot interval = later.Since(earlier);
+  EXPECT_EQ(interval.count(), 1u);
+  EXPECT_EQ(interval.total(), 5000u);
+  EXPECT_EQ(interval.count(LatencyHistogram::Bucket(5000)), 1u);
+  EXPECT_EQ(interval.count(LatencyHistogram::Bucket(100)), 0u);
+}
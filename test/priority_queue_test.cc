@@ -0,0 +1,110 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "priority_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using hindsightgrpc::PriorityQueue;
+
+// Pops everything, in order
+static std::vector<int> drain(PriorityQueue<int>& queue) {
+  std::vector<int> items;
+  int item;
+  while (queue.Pop(item)) {
+    items.push_back(item);
+  }
+  return items;
+}
+
+TEST(PriorityQueue, StrictTakesMostImportantFirst) {
+  PriorityQueue<int> queue(hindsightgrpc::STRICT_PRIORITY);
+  queue.Push(10, 0);
+  queue.Push(30, 3);
+  queue.Push(20, 1);
+  queue.Push(31, 3);
+  queue.Push(11, 0);
+  EXPECT_EQ(queue.size(), 5u);
+  EXPECT_EQ(drain(queue), std::vector<int>({30, 31, 20, 10, 11}));
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(PriorityQueue, ClampsPriorities) {
+  PriorityQueue<int> queue;
+  queue.Push(1, -5);
+  queue.Push(2, 100);
+  queue.Push(3, 3);
+  EXPECT_EQ(drain(queue), std::vector<int>({2, 3, 1}));
+}
+
+TEST(PriorityQueue, PopBackTakesNewestOfTheClass) {
+  PriorityQueue<int> queue;
+  queue.Push(1, 2);
+  queue.Push(2, 2);
+  queue.Push(3, 1);
+  int item;
+  ASSERT_TRUE(queue.PopBack(item));
+  EXPECT_EQ(item, 2);
+  ASSERT_TRUE(queue.PopBack(item));
+  EXPECT_EQ(item, 1);
+  ASSERT_TRUE(queue.PopBack(item));
+  EXPECT_EQ(item, 3);
+  EXPECT_FALSE(queue.PopBack(item));
+}
+
+TEST(PriorityQueue, PopLeastImportantOnlyShedsLowerClasses) {
+  PriorityQueue<int> queue;
+  queue.Push(10, 1);
+  queue.Push(11, 1);
+  queue.Push(20, 2);
+  int item;
+  EXPECT_FALSE(queue.PopLeastImportant(item, 1));
+  ASSERT_TRUE(queue.PopLeastImportant(item, 3));
+  EXPECT_EQ(item, 11);
+  ASSERT_TRUE(queue.PopLeastImportant(item, 3));
+  EXPECT_EQ(item, 10);
+  ASSERT_TRUE(queue.PopLeastImportant(item, 3));
+  EXPECT_EQ(item, 20);
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(PriorityQueue, WeightedFairTakesInProportionToPriority) {
+  PriorityQueue<int> queue(hindsightgrpc::WEIGHTED_FAIR);
+  for (int i = 0; i < 100; i++) {
+    for (int c = 0; c < PriorityQueue<int>::classes; c++) {
+      queue.Push(c, c);
+    }
+  }
+  // Each round of 1+2+3+4 pops takes priority+1 from each class
+  std::vector<int> taken(PriorityQueue<int>::classes, 0);
+  int item;
+  for (int i = 0; i < 10 * 10; i++) {
+    ASSERT_TRUE(queue.Pop(item));
+    taken[item]++;
+  }
+  EXPECT_EQ(taken, std::vector<int>({10, 20, 30, 40}));
+}
+
+TEST(PriorityQueue, WeightedFairDoesNotStarveLowPriority) {
+  PriorityQueue<int> queue(hindsightgrpc::WEIGHTED_FAIR);
+  queue.Push(0, 0);
+  for (int i = 0; i < 10; i++) {
+    queue.Push(3, 3);
+  }
+  std::vector<int> items = drain(queue);
+  ASSERT_EQ(items.size(), 11u);
+  int position = 0;
+  while (items[position] != 0) position++;
+  EXPECT_LE(position, 4);
+}
+
+TEST(PriorityQueue, WeightedFairKeepsFifoWithinAClass) {
+  PriorityQueue<int> queue(hindsightgrpc::WEIGHTED_FAIR);
+  queue.Push(1, 2);
+  queue.Push(2, 2);
+  queue.Push(3, 2);
+  EXPECT_EQ(drain(queue), std::vector<int>({1, 2, 3}));
+}
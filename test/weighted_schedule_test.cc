@@ -0,0 +1,41 @@
+/*
+ * Copyright 2022 Max Planck Institute for Software Systems *
+ */
+
+#include "weighted_schedule.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using hindsightgrpc::weighted_schedule;
+
+TEST(WeightedSchedule, SpreadsOutTheHeaviestTarget) {
+  EXPECT_EQ(weighted_schedule({5, 1, 1}), std::vector<int>({0, 0, 1, 0, 2, 0, 0}));
+}
+
+TEST(WeightedSchedule, EqualWeightsRoundRobin) {
+  EXPECT_EQ(weighted_schedule({1, 1, 1}), std::vector<int>({0, 1, 2}));
+  EXPECT_EQ(weighted_schedule({2, 2}), std::vector<int>({0, 1, 0, 1}));
+}
+
+TEST(WeightedSchedule, PicksEachTargetByWeight) {
+  std::vector<int> weights = {3, 0, 7, 2};
+  std::vector<int> picks(weights.size(), 0);
+  for (int target : weighted_schedule(weights)) {
+    picks[target]++;
+  }
+  EXPECT_EQ(picks, weights);
+}
+
+TEST(WeightedSchedule, NegativeWeightsCountAsZero) {
+  EXPECT_EQ(weighted_schedule({-4, 2}), std::vector<int>({1, 1}));
+}
+
+TEST(WeightedSchedule, AllZeroWeightsRoundRobin) {
+  EXPECT_EQ(weighted_schedule({0, 0, 0}), std::vector<int>({0, 1, 2}));
+}
+
+TEST(WeightedSchedule, SingleTarget) {
+  EXPECT_EQ(weighted_schedule({4}), std::vector<int>({0, 0, 0, 0}));
+}